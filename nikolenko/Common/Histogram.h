@@ -0,0 +1,78 @@
+// Histogram.h
+// Histogram of latencies, shared by server statistics and kvbench.
+
+#ifndef TCP_TEST_HISTOGRAM_H
+#define TCP_TEST_HISTOGRAM_H
+
+#include <boost/integer/integer_log2.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram of durations in nanoseconds: every power of two is
+// split into 4 buckets, so a percentile is known within 25 percent.
+class LatencyHistogram {
+    static const unsigned    m_sub_bits = 2;
+    static const std::size_t m_buckets  = 64 << m_sub_bits;
+
+    std::atomic<std::uint64_t> m_counts[m_buckets];
+    std::atomic<std::uint64_t> m_count {0};
+    std::atomic<std::uint64_t> m_sum_ns{0};
+
+public:
+    LatencyHistogram()
+    {
+        for (auto& c : m_counts) c.store(0, std::memory_order_relaxed);
+    }
+
+    void record(std::uint64_t ns)
+    {
+        m_counts[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_count .fetch_add(1,  std::memory_order_relaxed);
+        m_sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    std::uint64_t count()  const { return m_count .load(std::memory_order_relaxed); }
+    std::uint64_t sum_ns() const { return m_sum_ns.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding quantile q (0..1), 0 if empty.
+    std::uint64_t percentile(double q) const
+    {
+        std::uint64_t counts[m_buckets];
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < m_buckets; ++i)
+            total += counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        if (!total) return 0;
+
+        auto rank = (std::uint64_t)(q * total);
+        if (rank >= total) rank = total - 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < m_buckets; ++i) {
+            seen += counts[i];
+            if (seen > rank) return upper_bound_of(i);
+        }
+        return upper_bound_of(m_buckets - 1);
+    }
+
+private:
+    static std::size_t bucket_of(std::uint64_t ns)
+    {
+        const std::uint64_t first = 1u << m_sub_bits;
+        if (ns < first) return (std::size_t)ns;
+        unsigned e   = boost::integer_log2(ns);
+        auto     sub = (ns >> (e - m_sub_bits)) & (first - 1);
+        return (std::size_t)((e - m_sub_bits + 1) * first + sub);
+    }
+
+    static std::uint64_t upper_bound_of(std::size_t bucket)
+    {
+        const std::uint64_t first = 1u << m_sub_bits;
+        if (bucket < first) return bucket;
+        unsigned e   = (unsigned)(bucket / first) + m_sub_bits - 1;
+        auto     sub = bucket % first;
+        return ((first + sub + 1) << (e - m_sub_bits)) - 1;
+    }
+};
+
+#endif // TCP_TEST_HISTOGRAM_H
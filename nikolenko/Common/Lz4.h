@@ -0,0 +1,170 @@
+// Lz4.h
+// Compression of values in the LZ4 block format, shared by server and client.
+//
+// Block is a sequence of literals and matches: token with 4 bits of length
+// of literals and 4 bits of length of match, longer lengths continue in
+// bytes of 255, then literals, then 2 bytes of offset of match back in the
+// output. The last 5 bytes are always literals. Blocks made here are read
+// by any LZ4 decoder (LZ4_decompress_safe) and the other way round, so a
+// client in another language unpacks values by its LZ4 library.
+//
+// Compressor is the fast greedy one: hash table of 4 byte sequences, no
+// search of the longest match, the step grows over data which does not
+// compress. Decompressor checks every length and offset against the ends
+// of both buffers, a damaged block is refused.
+
+#ifndef TCP_TEST_LZ4_H
+#define TCP_TEST_LZ4_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace lz4 {
+
+namespace detail {
+
+const std::size_t min_match     = 4;
+const std::size_t last_literals = 5;
+const std::size_t match_limit   = 12;       // Last match starts before it
+const std::size_t max_offset    = 65535;
+const unsigned    hash_bits     = 12;
+
+inline std::uint32_t read32(const char* p)
+{
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline std::uint32_t hash(const char* p)
+{
+    return (read32(p) * 2654435761u) >> (32 - hash_bits);
+}
+
+// Length above 15 in the token, the rest in bytes.
+inline char* write_length(char* out, std::size_t length)
+{
+    for (; length >= 255; length -= 255) *out++ = (char)255;
+    *out++ = (char)length;
+    return out;
+}
+
+inline bool read_length(const unsigned char*& in, const unsigned char* end, std::size_t& length)
+{
+    unsigned b;
+    do {
+        if (in == end) return false;
+        b = *in++;
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+inline char* write_sequence(char* out, const char* literals, std::size_t n, std::size_t offset, std::size_t match)
+{
+    char* token = out++;
+    *token = (char)((n >= 15 ? 15 : n) << 4);
+    if (n >= 15) out = write_length(out, n - 15);
+    std::memcpy(out, literals, n);
+    out += n;
+    if (!offset) return out;
+    *out++ = (char)(offset & 0xff);
+    *out++ = (char)(offset >> 8);
+    match -= min_match;
+    *token = (char)(*token | (match >= 15 ? 15 : match));
+    if (match >= 15) out = write_length(out, match - 15);
+    return out;
+}
+
+} // namespace detail
+
+// Bytes of output enough for any input of size bytes.
+inline std::size_t bound(std::size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+// Compress size bytes of in to out, which has bound(size) bytes.
+// Return bytes of block.
+inline std::size_t compress(const char* in, std::size_t size, char* out)
+{
+    using namespace detail;
+    const char* anchor = in;            // Literals start here
+    const char* end    = in + size;
+    char*       op     = out;
+
+    if (size > match_limit) {
+        std::uint32_t table[1u << hash_bits] = {};
+        const char*   limit     = end - match_limit;
+        const char*   match_end = end - last_literals;
+        const char*   ip        = in + 1;
+        while (ip < limit) {
+            std::uint32_t h   = hash(ip);
+            const char*   ref = in + table[h];
+            table[h] = (std::uint32_t)(ip - in);
+            if (ref >= ip || (std::size_t)(ip - ref) > max_offset || read32(ref) != read32(ip)) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            const char* m = ip + min_match;
+            const char* r = ref + min_match;
+            while (m < match_end && *m == *r) {
+                ++m;
+                ++r;
+            }
+            op     = write_sequence(op, anchor, (std::size_t)(ip - anchor), (std::size_t)(ip - ref), (std::size_t)(m - ip));
+            ip     = m;
+            anchor = ip;
+            if (ip < limit) table[hash(ip - 2)] = (std::uint32_t)(ip - 2 - in);
+        }
+    }
+    op = write_sequence(op, anchor, (std::size_t)(end - anchor), 0, 0);
+    return (std::size_t)(op - out);
+}
+
+// Decompress block of size bytes to out, which takes exactly length bytes.
+// Return false when the block is damaged or gives another length.
+inline bool decompress(const char* in, std::size_t size, char* out, std::size_t length)
+{
+    using namespace detail;
+    const unsigned char* ip   = reinterpret_cast<const unsigned char*>(in);
+    const unsigned char* iend = ip + size;
+    char*                op   = out;
+    char*                oend = out + length;
+
+    for (;;) {
+        if (ip == iend) return false;
+        unsigned    token = *ip++;
+        std::size_t n     = token >> 4;
+        if (n == 15 && !read_length(ip, iend, n)) return false;
+        if ((std::size_t)(iend - ip) < n || (std::size_t)(oend - op) < n) return false;
+        std::memcpy(op, ip, n);
+        op += n;
+        ip += n;
+        // The last sequence has literals only.
+        if (ip == iend) return op == oend;
+
+        if (iend - ip < 2) return false;
+        std::size_t offset = ip[0] | (std::size_t)ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > (std::size_t)(op - out)) return false;
+        std::size_t match = token & 15;
+        if (match == 15 && !read_length(ip, iend, match)) return false;
+        match += min_match;
+        if ((std::size_t)(oend - op) < match) return false;
+        const char* from = op - offset;
+        // Match may overlap its own output: short offset repeats bytes.
+        if (offset >= match) std::memcpy(op, from, match);
+        else for (std::size_t i = 0; i < match; ++i) op[i] = from[i];
+        op += match;
+    }
+}
+
+} // namespace lz4
+
+#endif // TCP_TEST_LZ4_H
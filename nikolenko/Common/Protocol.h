@@ -0,0 +1,471 @@
+// Protocol.h
+// Binary protocol of the key-value test server, shared by server and client.
+//
+// Every request is a frame:
+//     RequestHeader  - opcode, flags, key length, value length;
+//     payload        - key bytes followed by value bytes.
+// Every answer is a frame:
+//     ResponseHeader - status, flags, payload length, version;
+//     payload        - value for successful GET, text of statistics for
+//                      STATS, empty otherwise.
+//
+// Every change of key gives it a new version, greater than all versions
+// given before by the server. Answer to a command of one key carries the
+// version of key after it, 0 when the key is absent: GET, INSERT, UPDATE
+// and CAS return it on success and on failure as well, so a failed CAS may
+// be retried at once with the returned version.
+//
+// CAS and CDELETE change the key only when its version is the expected one,
+// value of request is CasParams (expected version) followed by the new value
+// for CAS. CAS with version 0 inserts the key when it is absent. UPDATE with
+// the value which the key has already fails with StatusUnchanged.
+//
+// Key may have time to live in seconds. INSERT, UPDATE and CAS with flag
+// RequestTtl have TtlParams before the rest of value: TTL 0 - the key never
+// expires, TTL beyond the 32-bit clock of server ends at its last second.
+// UPDATE and CAS without it keep TTL of key. EXPIRE sets TTL of
+// existing key, value of request is TtlParams. Expired key is absent for
+// all commands, it is deleted by the server in background.
+//
+// Batch commands MGET, MSET and MDELETE carry the number of items in the
+// key length field of header and the items in payload:
+//     BatchItemHeader   - key length, value length (0 for MGET, MDELETE);
+//     key, value.
+// Answer is StatusOk with the result of every item in request order:
+//     BatchResultHeader - status of item, value length (MGET only);
+//     value.
+// Answer of MGET is at most max_batch_length bytes, as any other answer
+// frame except the feed of SYNC: item whose value does not fit has
+// StatusTooLarge and no value, it may be taken by GET.
+//
+// SCAN and PREFIX iterate keys in order: SCAN from the key of request,
+// PREFIX over keys starting with it. Value of request is ScanParams (limit
+// of items, 0 - no limit) and optional cursor: the last key received, the
+// scan goes on after it. Answer is streamed as several frames, every one
+// holds the next items as BatchItemHeader, key, value. ResponseMore flag
+// marks all frames but the last one, ResponseTruncated flag of the last
+// frame tells that the limit is reached and more keys may follow.
+//
+// SYNC is sent by replica to primary server and is answered by an endless
+// stream of frames with ResponseMore flag. Their payload is records of the
+// journal of primary (see TCP-Server/Journal.h): first a copy of all items
+// with LSN 0, then records of changes in order of their LSN. Version of the
+// first frame is the LSN after which the changes go, the frame which ends
+// the copy has ResponseSynced flag, version of the next frames is the last
+// LSN of primary. Frame without records is sent when primary is idle.
+// Replica answers changes by StatusReadOnly.
+//
+// Server may keep large values compressed. GET with RequestCompressed flag
+// accepts the value as it is kept: answer with ResponseCompressed flag has
+// compressed value in payload, CompressedHeader (length of value) followed
+// by LZ4 block of it (see Lz4.h), and server sends it without unpacking.
+// Without the flag, and for MGET and SCAN, values are always plain.
+//
+// Server limits the number of connections: the next one gets one answer
+// with StatusBusy and is closed, client should connect again later. Server
+// closes connection which sends no request for the idle timeout, and the
+// one which does not send the rest of frame or does not read its answers
+// for the request timeout.
+//
+// Header structures are adapted by boost::fusion and serialized field by
+// field in network byte order, so adding a field to a header is enough to
+// get it on the wire.
+
+#ifndef TCP_TEST_PROTOCOL_H
+#define TCP_TEST_PROTOCOL_H
+
+#include <boost/fusion/include/adapt_struct.hpp>
+#include <boost/fusion/include/for_each.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include <vector>
+
+#include "Lz4.h"
+
+namespace protocol {
+
+//-----------------------------------------------------------------------------
+// Limits from the specification
+//-----------------------------------------------------------------------------
+
+const std::size_t max_key_length   = 1024;
+const std::size_t max_value_length = 1024 * 1024;
+const std::size_t max_batch_items  = 1024;
+const std::size_t max_batch_length = 16 * 1024 * 1024;
+
+//-----------------------------------------------------------------------------
+// Commands and answers
+//-----------------------------------------------------------------------------
+
+enum Opcode : std::uint8_t {
+    OpInsert  = 1,
+    OpUpdate  = 2,
+    OpDelete  = 3,
+    OpGet     = 4,
+    OpStats   = 5,  // Statistics of server in the Prometheus text format
+    OpMGet    = 6,  // GET of many keys
+    OpMSet    = 7,  // INSERT or UPDATE of many keys
+    OpMDelete = 8,  // DELETE of many keys
+    OpScan    = 9,  // Keys and values in order from the given key
+    OpPrefix  = 10, // Keys and values with the given prefix in order
+    OpCas     = 11, // UPDATE, or INSERT for version 0, of the expected version
+    OpCDelete = 12, // DELETE of the expected version
+    OpExpire  = 13, // Time to live of key
+    OpSync    = 14, // Copy of storage and stream of changes for replica
+    OpLast    = OpSync,
+};
+
+enum Status : std::uint8_t {
+    StatusOk         = 0,
+    StatusExists     = 1,   // INSERT of already existing key
+    StatusNotFound   = 2,   // UPDATE, DELETE, GET of absent key
+    StatusFailed     = 3,   // Storage could not execute the command
+    StatusBadRequest = 4,   // Unknown opcode or limits are exceeded
+    StatusUnchanged  = 5,   // UPDATE with the same value
+    StatusConflict   = 6,   // CAS, CDELETE of another version
+    StatusReadOnly   = 7,   // Change sent to replica
+    StatusBusy       = 8,   // Too many connections, this one is closed
+    StatusTooLarge   = 9,   // Item of MGET does not fit into the answer
+};
+
+struct RequestHeader {
+    std::uint8_t  opcode       = 0;
+    std::uint8_t  flags        = 0;
+    std::uint16_t key_length   = 0;
+    std::uint32_t value_length = 0;
+};
+
+enum RequestFlags : std::uint8_t {
+    RequestTtl        = 1,  // TtlParams precede value of INSERT, UPDATE, CAS
+    RequestCompressed = 2,  // GET accepts compressed value
+};
+
+struct ResponseHeader {
+    std::uint8_t  status       = StatusOk;
+    std::uint8_t  flags        = 0;
+    std::uint16_t reserved     = 0;
+    std::uint32_t length       = 0;
+    std::uint64_t version      = 0;
+};
+
+enum ResponseFlags : std::uint8_t {
+    ResponseMore       = 1, // Next frame continues this answer
+    ResponseTruncated  = 2, // Limit of SCAN is reached
+    ResponseSynced     = 4, // Copy of SYNC is complete, changes follow
+    ResponseCompressed = 8, // Payload of GET is compressed value
+};
+
+struct ScanParams {
+    std::uint32_t limit        = 0;
+};
+
+struct CasParams {
+    std::uint64_t version      = 0;
+};
+
+struct TtlParams {
+    std::uint32_t ttl          = 0;   // Seconds, 0 - never expires
+};
+
+struct CompressedHeader {
+    std::uint32_t length       = 0;   // Bytes of value before compression
+};
+
+struct BatchItemHeader {
+    std::uint16_t key_length   = 0;
+    std::uint32_t value_length = 0;
+};
+
+struct BatchResultHeader {
+    std::uint8_t  status       = StatusOk;
+    std::uint32_t length       = 0;
+};
+
+// Item of batch request, points into the payload.
+struct BatchItem {
+    boost::string_view key;
+    boost::string_view value;
+};
+
+} // namespace protocol
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::RequestHeader,
+    opcode,
+    flags,
+    key_length,
+    value_length
+)
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::ResponseHeader,
+    status,
+    flags,
+    reserved,
+    length,
+    version
+)
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::ScanParams,
+    limit
+)
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::CasParams,
+    version
+)
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::TtlParams,
+    ttl
+)
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::CompressedHeader,
+    length
+)
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::BatchItemHeader,
+    key_length,
+    value_length
+)
+
+BOOST_FUSION_ADAPT_STRUCT(
+    protocol::BatchResultHeader,
+    status,
+    length
+)
+
+namespace protocol {
+
+//-----------------------------------------------------------------------------
+// Serialization of fusion sequences with integral fields
+//-----------------------------------------------------------------------------
+
+namespace detail {
+
+struct FieldWriter {
+    char*& out;
+    template<typename T> void operator()(const T& v) const {
+        for (int i = sizeof(T) - 1; i >= 0; --i)
+            *out++ = (char)((std::uint64_t)v >> (8 * i));
+    }
+};
+
+struct FieldReader {
+    const char*& in;
+    template<typename T> void operator()(T& v) const {
+        std::uint64_t r = 0;
+        for (std::size_t i = 0; i < sizeof(T); ++i)
+            r = (r << 8) | (unsigned char)*in++;
+        v = (T)r;
+    }
+};
+
+} // namespace detail
+
+// Write structure to out, return pointer past the written bytes.
+template<typename S>
+char* encode(const S& s, char* out)
+{
+    boost::fusion::for_each(s, detail::FieldWriter{out});
+    return out;
+}
+
+// Read structure from in, return pointer past the read bytes.
+template<typename S>
+const char* decode(S& s, const char* in)
+{
+    boost::fusion::for_each(s, detail::FieldReader{in});
+    return in;
+}
+
+const std::size_t request_header_size  = 8;
+const std::size_t response_header_size = 16;
+// Batch headers are packed on the wire, their structs are padded.
+const std::size_t batch_item_size      = 2 + 4;
+const std::size_t batch_result_size    = 1 + 4;
+const std::size_t scan_params_size     = 4;
+const std::size_t cas_params_size      = 8;
+const std::size_t ttl_params_size      = 4;
+const std::size_t compressed_header_size = 4;
+
+// Headers have no padding, so the sum of fields equals to the size of struct.
+static_assert(sizeof(RequestHeader)  == request_header_size,  "RequestHeader layout");
+static_assert(sizeof(ResponseHeader) == response_header_size, "ResponseHeader layout");
+
+//-----------------------------------------------------------------------------
+// Names
+//-----------------------------------------------------------------------------
+
+inline const char* opcode_name(std::uint8_t op)
+{
+    switch (op) {
+    case OpInsert:  return "INSERT";
+    case OpUpdate:  return "UPDATE";
+    case OpDelete:  return "DELETE";
+    case OpGet:     return "GET";
+    case OpStats:   return "STATS";
+    case OpMGet:    return "MGET";
+    case OpMSet:    return "MSET";
+    case OpMDelete: return "MDELETE";
+    case OpScan:    return "SCAN";
+    case OpPrefix:  return "PREFIX";
+    case OpCas:     return "CAS";
+    case OpCDelete: return "CDELETE";
+    case OpExpire:  return "EXPIRE";
+    case OpSync:    return "SYNC";
+    }
+    return "UNKNOWN";
+}
+
+// Return 0 for unknown command name.
+inline std::uint8_t opcode_by_name(std::string name)
+{
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    for (std::uint8_t op = OpInsert; op <= OpLast; ++op)
+        if (name == opcode_name(op)) return op;
+    return 0;
+}
+
+inline const char* status_name(std::uint8_t status)
+{
+    switch (status) {
+    case StatusOk:         return "OK";
+    case StatusExists:     return "EXISTS";
+    case StatusNotFound:   return "NOT_FOUND";
+    case StatusFailed:     return "FAILED";
+    case StatusBadRequest: return "BAD_REQUEST";
+    case StatusUnchanged:  return "UNCHANGED";
+    case StatusConflict:   return "CONFLICT";
+    case StatusReadOnly:   return "READONLY";
+    case StatusBusy:       return "BUSY";
+    case StatusTooLarge:   return "TOO_LARGE";
+    }
+    return "UNKNOWN";
+}
+
+inline bool is_batch(std::uint8_t op)
+{
+    return op == OpMGet || op == OpMSet || op == OpMDelete;
+}
+
+inline bool is_scan(std::uint8_t op)
+{
+    return op == OpScan || op == OpPrefix;
+}
+
+// Commands which change storage.
+inline bool is_change(std::uint8_t op)
+{
+    return op != OpGet && op != OpStats && op != OpMGet && !is_scan(op) && op != OpSync;
+}
+
+// Bytes of request after its header.
+inline std::size_t payload_length(const RequestHeader& h)
+{
+    return is_batch(h.opcode) ? h.value_length : (std::size_t)h.key_length + h.value_length;
+}
+
+// Check request header against the limits of protocol.
+inline bool valid_request(const RequestHeader& h)
+{
+    if (h.opcode == OpStats || h.opcode == OpSync) return h.key_length == 0 && h.value_length == 0;
+    if (is_scan(h.opcode)) {
+        return h.key_length <= max_key_length &&
+               h.value_length >= scan_params_size && h.value_length <= scan_params_size + max_key_length;
+    }
+    if (is_batch(h.opcode)) {
+        return h.key_length > 0 && h.key_length <= max_batch_items &&
+               h.value_length >= h.key_length * batch_item_size && h.value_length <= max_batch_length;
+    }
+    if (h.key_length == 0 || h.key_length > max_key_length) return false;
+    if ((h.flags & RequestCompressed) && h.opcode != OpGet) return false;
+    // TTL of INSERT, UPDATE and CAS is before the rest of value.
+    std::size_t length = h.value_length;
+    if (h.flags & RequestTtl) {
+        if (h.opcode != OpInsert && h.opcode != OpUpdate && h.opcode != OpCas) return false;
+        if (length < ttl_params_size) return false;
+        length -= ttl_params_size;
+    }
+    switch (h.opcode) {
+    case OpInsert:
+    case OpUpdate:  return length <= max_value_length;
+    case OpDelete:
+    case OpGet:     return length == 0;
+    case OpCas:     return length >= cas_params_size && length - cas_params_size <= max_value_length;
+    case OpCDelete: return length == cas_params_size;
+    case OpExpire:  return length == ttl_params_size;
+    }
+    return false;
+}
+
+// Split payload of batch request into items, false when it is malformed.
+inline bool decode_batch(const RequestHeader& h, const char* payload, std::vector<BatchItem>& items)
+{
+    items.clear();
+    const char* end = payload + h.value_length;
+    for (std::size_t i = 0; i < h.key_length; ++i) {
+        BatchItemHeader ih;
+        if ((std::size_t)(end - payload) < batch_item_size) return false;
+        payload = decode(ih, payload);
+        if (ih.key_length == 0 || ih.key_length > max_key_length) return false;
+        if (ih.value_length > max_value_length) return false;
+        if (h.opcode != OpMSet && ih.value_length) return false;
+        if ((std::size_t)(end - payload) < (std::size_t)ih.key_length + ih.value_length) return false;
+        items.push_back({ boost::string_view(payload, ih.key_length),
+                          boost::string_view(payload + ih.key_length, ih.value_length) });
+        payload += ih.key_length + ih.value_length;
+    }
+    return payload == end;
+}
+
+//-----------------------------------------------------------------------------
+// Compressed values
+//-----------------------------------------------------------------------------
+
+// Append compressed value to out. Return false and leave out as it was when
+// compressed value is not shorter than the plain one.
+inline bool compress_value(boost::string_view val, std::string& out)
+{
+    std::size_t pos = out.size();
+    out.resize(pos + compressed_header_size + lz4::bound(val.size()));
+    CompressedHeader h;
+    h.length = (std::uint32_t)val.size();
+    encode(h, &out[pos]);
+    std::size_t size = compressed_header_size + lz4::compress(val.data(), val.size(), &out[pos + compressed_header_size]);
+    out.resize(size < val.size() ? pos + size : pos);
+    return size < val.size();
+}
+
+// Length of value before compression.
+inline std::size_t uncompressed_length(boost::string_view packed)
+{
+    CompressedHeader h;
+    if (packed.size() >= compressed_header_size) decode(h, packed.data());
+    return h.length;
+}
+
+// Append value of compressed one to out, false when it is damaged.
+inline bool uncompress_value(boost::string_view packed, std::string& out)
+{
+    if (packed.size() < compressed_header_size) return false;
+    std::size_t length = uncompressed_length(packed);
+    if (length > max_value_length) return false;
+    std::size_t pos = out.size();
+    out.resize(pos + length);
+    if (lz4::decompress(packed.data() + compressed_header_size, packed.size() - compressed_header_size, &out[pos], length)) 
+        return true;
+    out.resize(pos);
+    return false;
+}
+
+} // namespace protocol
+
+#endif // TCP_TEST_PROTOCOL_H
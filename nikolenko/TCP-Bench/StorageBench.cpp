@@ -0,0 +1,126 @@
+// StorageBench.cpp
+// Microbenchmark of storage shards: cost of INSERT, UPDATE, GET and DELETE
+// for the layout the binary is built with (see Storage.h):
+//     storagebench             - ordered key index;
+//     storagebench_hashed      - hashed key index;
+//     storagebench_value_index - ordered key index and index on values;
+//     storagebench_swiss       - ordered key index and Swiss table for
+//                                lookups by key.
+//
+// Usage: storagebench [count [value_size [file]]]
+// For latency of GET by size of shards run it with 1M, 10M and 100M keys,
+// the last one needs about 16 GB of memory with 16 bytes values.
+// Journal is off, so only the shards and the mapped file are measured.
+// Memory is bytes of the file taken per item: index, key and value.
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Storage.h"
+#include "Histogram.h"
+
+namespace {
+
+std::string make_value(std::mt19937& rnd, std::size_t size)
+{
+    std::string v(size, ' ');
+    for (auto& c : v) c = (char)('a' + rnd() % 26);
+    return v;
+}
+
+// Run f(i) for every key, print and return nanoseconds per operation.
+template<typename F>
+double measure(const char* name, std::size_t count, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < count; ++i) f(i);
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    double per_op = (double)ns / count;
+    std::printf("%-8s %10.1f ns/op %12.0f ops/s\n", name, per_op, 1e9 / per_op);
+    return per_op;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::size_t count      = argc > 1 ? std::stoul(argv[1]) : 200000;
+    std::size_t value_size = argc > 2 ? std::stoul(argv[2]) : 100;
+    std::string file       = argc > 3 ? argv[3] : "./storagebench_storage";
+    if (!count) return 1;
+
+    std::printf("layout %u: %s keys%s, %zu keys, %zu bytes values\n", storage_layout,
+#if defined(STORAGE_HASHED_KEYS)
+        "hashed",
+#else
+        "ordered",
+#endif
+#if defined(STORAGE_VALUE_INDEX)
+        ", value index",
+#elif defined(STORAGE_SWISS_INDEX)
+        ", swiss index",
+#else
+        "",
+#endif
+        count, value_size);
+
+    // Keys are shuffled, so the index is not filled in order.
+    std::mt19937 rnd(12345);
+    std::vector<std::string> keys(count);
+    for (std::size_t i = 0; i < count; ++i) keys[i] = "key:" + std::to_string(i);
+    std::shuffle(keys.begin(), keys.end(), rnd);
+    std::vector<std::string> values(64);
+    for (auto& v : values) v = make_value(rnd, value_size);
+
+    file_mapping::remove(file.c_str());
+    JournalOptions journal;
+    journal.sync = JournalSync::Off;
+    Storage storage(16, journal);
+    if (storage.load(file)) return 1;
+
+    // The file is grown before measuring, growth is not a cost of layout.
+    std::size_t used = storage.memory_used();
+    for (std::size_t i = 0; i < count; ++i)
+        storage.execute(protocol::OpInsert, keys[i], values[i % values.size()], nullptr);
+    std::printf("%-8s %10.1f bytes/item\n", "MEMORY", (double)(storage.memory_used() - used) / count);
+    for (std::size_t i = 0; i < count; ++i)
+        storage.execute(protocol::OpDelete, keys[i], std::string(), nullptr);
+
+    std::string result;
+    const std::string none;
+    int errors = 0;
+    measure("INSERT", count, [&](std::size_t i) {
+        errors += storage.execute(protocol::OpInsert, keys[i], values[i % values.size()], nullptr) != protocol::StatusOk;
+    });
+    measure("UPDATE", count, [&](std::size_t i) {
+        errors += storage.execute(protocol::OpUpdate, keys[i], values[(i + 1) % values.size()], nullptr) != protocol::StatusOk;
+    });
+    measure("GET", count, [&](std::size_t i) {
+        result.clear();
+        errors += storage.execute(protocol::OpGet, keys[i], none, &result) != protocol::StatusOk;
+    });
+    // Latency of every GET, keys are in random order.
+    LatencyHistogram latency;
+    for (std::size_t i = 0; i < count; ++i) {
+        result.clear();
+        auto start = std::chrono::steady_clock::now();
+        errors += storage.execute(protocol::OpGet, keys[i], none, &result) != protocol::StatusOk;
+        latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+    std::printf("%-8s %10.0f ns p50 %8.0f ns p99 %8.0f ns p99.9\n", "GET",
+                (double)latency.percentile(0.5), (double)latency.percentile(0.99), (double)latency.percentile(0.999));
+    measure("DELETE", count, [&](std::size_t i) {
+        errors += storage.execute(protocol::OpDelete, keys[i], none, nullptr) != protocol::StatusOk;
+    });
+
+    storage.save();
+    file_mapping::remove(file.c_str());
+    if (errors) std::cout << errors << " commands failed." << std::endl;
+    return errors ? 1 : 0;
+}
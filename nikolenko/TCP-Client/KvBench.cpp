@@ -0,0 +1,489 @@
+// KvBench.cpp
+// Load generator of the key-value test server.
+//
+// Opens many connections, every one keeps a batch of requests in flight
+// (pipelining) and sends the next batch when all answers are received.
+// Commands are chosen by the given mix, keys by uniform or Zipfian
+// distribution, values by fixed, uniform or exponential distribution of
+// size. Throughput and latency percentiles of every command are reported.
+//
+// Latency of request is the time from the start of write of its batch to
+// the arrival of its answer.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "Protocol.h"
+#include "Histogram.h"
+
+using namespace boost::asio;
+
+typedef std::chrono::steady_clock Clock;
+
+//-----------------------------------------------------------------------------
+// Options
+//-----------------------------------------------------------------------------
+
+struct BenchOptions {
+    std::string  address     = "127.0.0.1";
+    unsigned int port        = 31415;
+    unsigned int connections = 16;
+    unsigned int pipeline    = 1;       // Requests in flight per connection
+    unsigned int threads     = 1;       // Threads running io_service
+    unsigned int duration    = 10;      // Seconds of measurement
+    unsigned int keys        = 100000;  // Size of key space
+    double       zipf        = 0;       // Theta of Zipfian keys, 0 - uniform
+    bool         preload     = false;   // INSERT every key before measurement
+
+    // Shares of commands in percents.
+    unsigned int mix[protocol::OpGet + 1] = { 0, 5, 10, 5, 80 };
+
+    // Size of values: fixed, uniform between min and max,
+    // or exponential with mean value_min limited by value_max.
+    enum { Fixed, Uniform, Exponential } value_distribution = Fixed;
+    unsigned int value_min   = 100;
+    unsigned int value_max   = 100;
+};
+
+BenchOptions options;
+
+// Mix "get:insert:update:delete" in percents, e.g. "80:5:10:5".
+bool parse_mix(const std::string& s, BenchOptions& opt)
+{
+    unsigned int get = 0, insert = 0, update = 0, del = 0;
+    if (std::sscanf(s.c_str(), "%u:%u:%u:%u", &get, &insert, &update, &del) != 4) return false;
+    if (get + insert + update + del != 100) return false;
+    opt.mix[protocol::OpGet]    = get;
+    opt.mix[protocol::OpInsert] = insert;
+    opt.mix[protocol::OpUpdate] = update;
+    opt.mix[protocol::OpDelete] = del;
+    return true;
+}
+
+// Size of values "N", "MIN-MAX" or "exp:MEAN".
+bool parse_value_size(const std::string& s, BenchOptions& opt)
+{
+    unsigned int a = 0, b = 0;
+    char tail = 0;
+    if (std::sscanf(s.c_str(), "exp:%u%c", &a, &tail) == 1 && a) {
+        opt.value_distribution = BenchOptions::Exponential;
+        opt.value_min = a;
+        opt.value_max = (unsigned int)std::min<std::size_t>(protocol::max_value_length, 16 * (std::size_t)a);
+        return true;
+    }
+    if (std::sscanf(s.c_str(), "%u-%u%c", &a, &b, &tail) == 2 && a && a <= b) {
+        opt.value_distribution = BenchOptions::Uniform;
+        opt.value_min = a;
+        opt.value_max = b;
+        return b <= protocol::max_value_length;
+    }
+    if (std::sscanf(s.c_str(), "%u%c", &a, &tail) == 1 && a) {
+        opt.value_distribution = BenchOptions::Fixed;
+        opt.value_min = opt.value_max = a;
+        return a <= protocol::max_value_length;
+    }
+    return false;
+}
+
+bool test_command_string(int argc, char* argv[], BenchOptions& opt)
+{
+    auto get_number = [&](int& i, unsigned int& value) -> bool {
+        if (++i >= argc) return false;
+        char* end = nullptr;
+        unsigned long n = strtoul(argv[i], &end, 10);
+        if (end == argv[i] || *end) return false;
+        value = (unsigned int)n;
+        return true;
+    };
+    auto get_string = [&](int& i, std::string& value) -> bool {
+        if (++i >= argc) return false;
+        value = argv[i];
+        return value.length() > 0;
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string s;
+        bool ok = true;
+        if      (arg == "-a" || arg == "--address")     ok = get_string(i, opt.address);
+        else if (arg == "--port")                       ok = get_number(i, opt.port) && opt.port && opt.port < 65536;
+        else if (arg == "-c" || arg == "--connections") ok = get_number(i, opt.connections) && opt.connections;
+        else if (arg == "-p" || arg == "--pipeline")    ok = get_number(i, opt.pipeline) && opt.pipeline;
+        else if (arg == "-t" || arg == "--threads")     ok = get_number(i, opt.threads) && opt.threads;
+        else if (arg == "-d" || arg == "--duration")    ok = get_number(i, opt.duration) && opt.duration;
+        else if (arg == "-k" || arg == "--keys")        ok = get_number(i, opt.keys) && opt.keys;
+        else if (arg == "--preload")                    opt.preload = true;
+        else if (arg == "-m" || arg == "--mix")         ok = get_string(i, s) && parse_mix(s, opt);
+        else if (arg == "-v" || arg == "--value-size")  ok = get_string(i, s) && parse_value_size(s, opt);
+        else if (arg == "-z" || arg == "--zipf") {
+            ok = get_string(i, s);
+            if (ok) opt.zipf = std::atof(s.c_str());
+            ok = ok && opt.zipf >= 0 && opt.zipf < 1;
+        }
+        else ok = false;
+        if (!ok) return false;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Distributions
+//-----------------------------------------------------------------------------
+
+// Zipfian numbers 0..n-1 with parameter theta in (0, 1): the lower number
+// the more often it is drawn. Algorithm of J. Gray et al. ("Quickly
+// generating billion-record synthetic databases"), as in YCSB.
+class ZipfGenerator {
+    std::uint64_t m_n;
+    double        m_theta, m_alpha, m_zetan, m_eta;
+
+    static double zeta(std::uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (std::uint64_t i = 1; i <= n; ++i) sum += 1 / std::pow((double)i, theta);
+        return sum;
+    }
+
+public:
+    ZipfGenerator(std::uint64_t n, double theta) :
+        m_n(n),
+        m_theta(theta),
+        m_alpha(1 / (1 - theta)),
+        m_zetan(zeta(n, theta))
+    {
+        m_eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / m_zetan);
+    }
+
+    // u is uniform in [0, 1).
+    std::uint64_t next(double u) const
+    {
+        double uz = u * m_zetan;
+        if (uz < 1) return 0;
+        if (uz < 1 + std::pow(0.5, m_theta)) return std::min<std::uint64_t>(1, m_n - 1);
+        auto r = (std::uint64_t)(m_n * std::pow(m_eta * u - m_eta + 1, m_alpha));
+        return std::min(r, m_n - 1);
+    }
+};
+
+//-----------------------------------------------------------------------------
+// Results
+//-----------------------------------------------------------------------------
+
+struct BenchResults {
+    LatencyHistogram           latency[protocol::OpGet + 1];
+    std::atomic<std::uint64_t> ok     [protocol::OpGet + 1];
+    std::atomic<std::uint64_t> bytes_out{0};
+    std::atomic<std::uint64_t> bytes_in {0};
+    std::atomic<std::uint64_t> errors   {0};   // Connections lost
+
+    BenchResults() { for (auto& n : ok) n = 0; }
+};
+
+//-----------------------------------------------------------------------------
+// Connection - one client, sends batches of requests until the deadline
+//-----------------------------------------------------------------------------
+
+class Connection : public boost::enable_shared_from_this<Connection>
+{
+    struct Request {
+        std::uint8_t opcode;
+        std::string  key;
+        std::size_t  value_length;
+    };
+
+    ip::tcp::socket     m_socket;
+    io_service::strand  m_strand;
+    unsigned int        m_index;
+    BenchResults&       m_results;
+    const ZipfGenerator* m_zipf;
+    const std::string&  m_values;       // Random bytes, values are its prefixes
+    Clock::time_point   m_deadline;
+
+    // Preload: INSERT of keys m_index, m_index + connections, ...
+    bool                m_preload;
+    std::uint64_t       m_next_key;
+
+    std::mt19937_64                        m_random;
+    std::uniform_real_distribution<double> m_unit{0.0, 1.0};
+
+    std::vector<Request>      m_batch;
+    std::vector<char>         m_output;
+    std::vector<char>         m_input;
+    std::size_t               m_input_size = 0;
+    std::size_t               m_answers    = 0;
+    bool                      m_written    = false;
+    Clock::time_point         m_batch_start;
+
+public:
+    Connection(io_service& service, unsigned int index, BenchResults& results,
+               const ZipfGenerator* zipf, const std::string& values, bool preload) :
+        m_socket(service),
+        m_strand(service),
+        m_index(index),
+        m_results(results),
+        m_zipf(zipf),
+        m_values(values),
+        m_preload(preload),
+        m_next_key(index),
+        m_random(index + 1),
+        m_input(64 * 1024)
+    {
+    }
+
+    void start(const ip::tcp::endpoint& endpoint, Clock::time_point deadline)
+    {
+        m_deadline = deadline;
+        m_socket.async_connect(endpoint, m_strand.wrap(
+            boost::bind(&Connection::on_connect, shared_from_this(), _1)));
+    }
+
+private:
+    void on_connect(const boost::system::error_code& err)
+    {
+        if (err) {
+            std::cout << "Connection error: " << err.message() << std::endl;
+            ++m_results.errors;
+            return;
+        }
+        m_socket.set_option(ip::tcp::no_delay(true));
+        send_batch();
+    }
+
+    // Next request, false when the work of connection is done.
+    bool next_request(Request& r)
+    {
+        if (m_preload) {
+            if (m_next_key >= options.keys) return false;
+            r.opcode = protocol::OpInsert;
+            r.key    = key_name(m_next_key);
+            r.value_length = value_length();
+            m_next_key += options.connections;
+            return true;
+        }
+        if (Clock::now() >= m_deadline) return false;
+
+        unsigned int p = (unsigned int)(m_random() % 100);
+        r.opcode = protocol::OpGet;
+        for (std::uint8_t op = protocol::OpInsert; op <= protocol::OpGet; ++op) {
+            if (p < options.mix[op]) { r.opcode = op; break; }
+            p -= options.mix[op];
+        }
+        double u = m_unit(m_random);
+        r.key = key_name(m_zipf ? m_zipf->next(u) : (std::uint64_t)(u * options.keys));
+        r.value_length = r.opcode == protocol::OpInsert || r.opcode == protocol::OpUpdate ? value_length() : 0;
+        return true;
+    }
+
+    static std::string key_name(std::uint64_t n)
+    {
+        return "key:" + std::to_string(n);
+    }
+
+    std::size_t value_length()
+    {
+        switch (options.value_distribution) {
+        case BenchOptions::Fixed:
+            return options.value_min;
+        case BenchOptions::Uniform:
+            return options.value_min + m_random() % (options.value_max - options.value_min + 1);
+        case BenchOptions::Exponential: {
+            std::exponential_distribution<double> e(1.0 / options.value_min);
+            return std::max<std::size_t>(1, std::min<std::size_t>(options.value_max, (std::size_t)e(m_random)));
+        }
+        }
+        return options.value_min;
+    }
+
+    void send_batch()
+    {
+        m_batch.clear();
+        m_output.clear();
+        Request r;
+        while (m_batch.size() < options.pipeline && next_request(r)) {
+            protocol::RequestHeader h;
+            h.opcode       = r.opcode;
+            h.key_length   = (std::uint16_t)r.key.length();
+            h.value_length = (std::uint32_t)r.value_length;
+            std::size_t pos = m_output.size();
+            m_output.resize(pos + protocol::request_header_size);
+            protocol::encode(h, &m_output[pos]);
+            m_output.insert(m_output.end(), r.key.begin(), r.key.end());
+            m_output.insert(m_output.end(), m_values.begin(), m_values.begin() + r.value_length);
+            m_batch.push_back(std::move(r));
+        }
+        if (m_batch.empty()) {
+            boost::system::error_code err;
+            m_socket.close(err);
+            return;
+        }
+
+        m_answers     = 0;
+        m_written     = false;
+        m_batch_start = Clock::now();
+        // Answers are read while the batch is written: server answers the
+        // first requests before it has read the last ones.
+        async_write(m_socket, buffer(m_output), m_strand.wrap(
+            boost::bind(&Connection::on_write, shared_from_this(), _1, _2)));
+        read();
+    }
+
+    void on_write(const boost::system::error_code& err, std::size_t bytes)
+    {
+        if (err) return fail(err);
+        m_results.bytes_out += bytes;
+        m_written = true;
+        if (m_answers == m_batch.size()) send_batch();
+    }
+
+    void read()
+    {
+        if (m_input.size() - m_input_size < 16 * 1024) m_input.resize(m_input_size + 64 * 1024);
+        auto buf = buffer(m_input.data() + m_input_size, m_input.size() - m_input_size);
+        m_socket.async_read_some(buf, m_strand.wrap(
+            boost::bind(&Connection::on_read, shared_from_this(), _1, _2)));
+    }
+
+    void on_read(const boost::system::error_code& err, std::size_t bytes)
+    {
+        if (err) return fail(err);
+        m_results.bytes_in += bytes;
+        m_input_size += bytes;
+        auto now = Clock::now();
+
+        std::size_t pos = 0;
+        while (m_input_size - pos >= protocol::response_header_size && m_answers < m_batch.size()) {
+            protocol::ResponseHeader h;
+            protocol::decode(h, m_input.data() + pos);
+            std::size_t frame_size = protocol::response_header_size + h.length;
+            if (m_input_size - pos < frame_size) {
+                if (m_input.size() - pos < frame_size) m_input.resize(pos + frame_size);
+                break;
+            }
+            auto& r = m_batch[m_answers++];
+            m_results.latency[r.opcode].record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_batch_start).count());
+            if (h.status == protocol::StatusOk) ++m_results.ok[r.opcode];
+            pos += frame_size;
+        }
+        if (pos) {
+            std::memmove(m_input.data(), m_input.data() + pos, m_input_size - pos);
+            m_input_size -= pos;
+        }
+
+        if (m_answers < m_batch.size()) read();
+        else if (m_written) send_batch();
+    }
+
+    void fail(const boost::system::error_code& err)
+    {
+        if (err == error::operation_aborted || !m_socket.is_open()) return;
+        std::cout << "Connection " << m_index << " error: " << err.message() << std::endl;
+        ++m_results.errors;
+        boost::system::error_code e;
+        m_socket.close(e);
+    }
+};
+
+//-----------------------------------------------------------------------------
+// Main program
+//-----------------------------------------------------------------------------
+
+// Run all connections until they are done, return seconds elapsed.
+double run(BenchResults& results, const ZipfGenerator* zipf, const std::string& values, bool preload)
+{
+    io_service service;
+    auto endpoint = ip::tcp::endpoint(ip::address::from_string(options.address), (unsigned short)options.port);
+    auto start    = Clock::now();
+    auto deadline = start + std::chrono::seconds(options.duration);
+    for (unsigned int i = 0; i < options.connections; ++i) {
+        auto c = boost::make_shared<Connection>(service, i, results, zipf, values, preload);
+        c->start(endpoint, deadline);
+    }
+
+    boost::thread_group workers;
+    for (unsigned int i = 1; i < options.threads; ++i)
+        workers.create_thread([&service] { service.run(); });
+    service.run();
+    workers.join_all();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const BenchResults& results, double seconds)
+{
+    std::uint64_t total = 0;
+    std::printf("%-8s %10s %7s %10s %10s %10s\n", "Command", "Count", "OK %", "p50 us", "p99 us", "p999 us");
+    for (std::uint8_t op = protocol::OpInsert; op <= protocol::OpGet; ++op) {
+        auto& h = results.latency[op];
+        if (!h.count()) continue;
+        total += h.count();
+        std::printf("%-8s %10llu %7.1f %10.1f %10.1f %10.1f\n", protocol::opcode_name(op),
+            (unsigned long long)h.count(), 100.0 * results.ok[op] / h.count(),
+            h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3);
+    }
+    std::printf("Total: %llu requests in %.2f s, %.0f requests/s, sent %.1f MB/s, received %.1f MB/s\n",
+        (unsigned long long)total, seconds, total / seconds,
+        results.bytes_out / seconds / 1e6, results.bytes_in / seconds / 1e6);
+    if (results.errors) std::printf("Connections lost: %llu\n", (unsigned long long)results.errors.load());
+}
+
+int main(int argc, char* argv[])
+{
+    if (!test_command_string(argc, argv, options)) {
+        std::cout << "Invalid command format." << std::endl;
+        std::cout << "Using: " << std::endl;
+        std::cout << "       kvbench [-a|--address <server address>] [--port <port>]" << std::endl;
+        std::cout << "               [-c|--connections <number>] [-p|--pipeline <requests in flight per connection>]" << std::endl;
+        std::cout << "               [-t|--threads <number>] [-d|--duration <seconds>]" << std::endl;
+        std::cout << "               [-k|--keys <size of key space>] [-z|--zipf <theta 0..1, 0 - uniform>]" << std::endl;
+        std::cout << "               [-m|--mix <get:insert:update:delete percents, 80:5:10:5>]" << std::endl;
+        std::cout << "               [-v|--value-size <bytes> | <min>-<max> | exp:<mean>]" << std::endl;
+        std::cout << "               [--preload]" << std::endl;
+        return 0;
+    }
+
+    std::string values(options.value_max, ' ');
+    std::mt19937 random(1);
+    for (auto& c : values) c = (char)('a' + random() % 26);
+
+    std::unique_ptr<ZipfGenerator> zipf;
+    if (options.zipf > 0) zipf.reset(new ZipfGenerator(options.keys, options.zipf));
+
+    std::printf("Server %s:%u, %u connections, pipeline %u, %u threads\n", options.address.c_str(),
+        options.port, options.connections, options.pipeline, options.threads);
+    std::printf("Keys %u (%s), mix get:insert:update:delete %u:%u:%u:%u, values %s%u-%u bytes\n", options.keys,
+        options.zipf > 0 ? ("zipf " + std::to_string(options.zipf)).c_str() : "uniform",
+        options.mix[protocol::OpGet], options.mix[protocol::OpInsert],
+        options.mix[protocol::OpUpdate], options.mix[protocol::OpDelete],
+        options.value_distribution == BenchOptions::Exponential ? "exponential, mean " : "",
+        options.value_min, options.value_max);
+
+    if (options.preload) {
+        BenchResults preload;
+        double seconds = run(preload, nullptr, values, true);
+        std::printf("Preload:\n");
+        report(preload, seconds);
+    }
+
+    BenchResults results;
+    double seconds = run(results, zipf.get(), values, false);
+    std::printf("Measurement:\n");
+    report(results, seconds);
+    return results.errors ? 1 : 0;
+}
@@ -0,0 +1,565 @@
+// KvClient.h
+// Client library of the key-value server, to be embedded into applications.
+//
+// KvClient keeps a pool of persistent connections to one server. Requests
+// may be sent from any thread: async_call() returns at once and the handler
+// is called on a thread running the io_service when the answer comes, call()
+// waits for the answer (never call it from a thread of that io_service).
+//
+// Requests of a connection are pipelined: they are written as soon as they
+// come, without waiting for the answers of previous ones, at most
+// KvClientOptions::pipeline of them are in flight. Answers come in the same
+// order, so handlers of one connection are called in order of requests.
+//
+// A broken connection is restored in background after a delay, doubled after
+// every failed attempt (deadline_timer, nothing blocks the io_service).
+// Requests written to the broken connection fail with its error, the client
+// can not know if they are executed. Requests not written yet wait for the
+// connection, they fail when it is not restored in connect_timeout.
+// Server with too many connections answers StatusBusy and closes the new
+// one: requests written to it fail with resource_unavailable_try_again, and
+// the connection is restored as a broken one.
+//
+// GET accepts values compressed by server (KvClientOptions::compression),
+// they are unpacked by the connection, so the handler gets them plain.
+
+#ifndef TCP_TEST_KV_CLIENT_H
+#define TCP_TEST_KV_CLIENT_H
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include "Protocol.h"
+
+struct KvClientOptions {
+    std::string    address     = "127.0.0.1";
+    unsigned short port        = 31415;
+    unsigned int   connections = 1;         // Size of pool
+    std::size_t    pipeline    = 256;       // Requests in flight per connection
+    bool           compression = true;      // GET gets compressed values
+    // Delay before reconnect, it is doubled after every failure up to max.
+    boost::posix_time::time_duration reconnect_min   = boost::posix_time::milliseconds(100);
+    boost::posix_time::time_duration reconnect_max   = boost::posix_time::seconds(5);
+    // Requests waiting for connection fail after that.
+    boost::posix_time::time_duration connect_timeout = boost::posix_time::seconds(30);
+};
+
+// Answer of server or error of connection. Answer streamed in several frames
+// (SCAN, PREFIX) is joined: payload of all frames, flags of the last one.
+// Version of key is given for commands of one key, 0 when it is absent.
+struct KvResult {
+    boost::system::error_code error;
+    std::uint8_t              status  = protocol::StatusFailed;
+    std::uint8_t              flags   = 0;
+    std::uint64_t             version = 0;
+    std::string               payload;
+
+    bool ok() const { return !error && status == protocol::StatusOk; }
+};
+
+typedef std::function<void(KvResult)> KvHandler;
+
+//-----------------------------------------------------------------------------
+// KvConnection - one connection of pool, all its work is in its strand
+//-----------------------------------------------------------------------------
+
+class KvConnection : public boost::enable_shared_from_this<KvConnection>
+{
+    struct Request {
+        std::string frame;
+        KvHandler   handler;
+    };
+
+    typedef boost::asio::deadline_timer    Timer;
+    typedef boost::posix_time::ptime       Time;
+
+    boost::asio::io_service::strand m_strand;
+    boost::asio::ip::tcp::socket    m_socket;
+    Timer                           m_timer;
+    boost::asio::ip::tcp::endpoint  m_endpoint;
+    const KvClientOptions           m_options;
+
+    bool                     m_connected = false;
+    bool                     m_writing   = false;
+    bool                     m_stopped   = false;
+    // Handlers of a closed socket see another generation and do nothing.
+    unsigned int             m_generation = 0;
+    boost::posix_time::time_duration m_backoff;
+    Time                     m_down_since;      // First failed connect
+
+    std::deque<Request>      m_queue;           // Not written yet
+    std::deque<KvHandler>    m_sent;            // Written, wait for answers
+    KvResult                 m_result;          // Answer being read
+    std::string              m_output;
+    std::vector<char>        m_input;
+    std::size_t              m_input_size = 0;
+    std::atomic<std::size_t> m_load{0};         // Requests queued and in flight
+
+public:
+    KvConnection(boost::asio::io_service& service, const boost::asio::ip::tcp::endpoint& endpoint,
+                 const KvClientOptions& options) :
+        m_strand(service),
+        m_socket(service),
+        m_timer(service),
+        m_endpoint(endpoint),
+        m_options(options),
+        m_backoff(options.reconnect_min),
+        m_input(64 * 1024)
+    {
+    }
+
+    std::size_t load() const { return m_load.load(std::memory_order_relaxed); }
+
+    void start()
+    {
+        m_strand.dispatch(boost::bind(&KvConnection::connect, shared_from_this()));
+    }
+
+    // Close connection, requests not answered yet fail.
+    void stop()
+    {
+        m_strand.dispatch(boost::bind(&KvConnection::do_stop, shared_from_this()));
+    }
+
+    // Frame is a request header and its payload.
+    void send(std::string frame, KvHandler handler)
+    {
+        ++m_load;
+        auto self = shared_from_this();
+        Request r{ std::move(frame), std::move(handler) };
+        m_strand.dispatch([self, r]() mutable { self->do_send(std::move(r)); });
+    }
+
+private:
+    void do_send(Request r)
+    {
+        if (m_stopped) {
+            complete(r.handler, boost::asio::error::operation_aborted);
+            return;
+        }
+        m_queue.push_back(std::move(r));
+        write();
+    }
+
+    void do_stop()
+    {
+        m_stopped = true;
+        boost::system::error_code err;
+        m_timer.cancel(err);
+        disconnect();
+        fail_sent(boost::asio::error::operation_aborted);
+        fail_queue(boost::asio::error::operation_aborted);
+    }
+
+    void connect()
+    {
+        if (m_stopped) return;
+        m_socket.async_connect(m_endpoint, m_strand.wrap(
+            boost::bind(&KvConnection::on_connect, shared_from_this(), m_generation, _1)));
+    }
+
+    void on_connect(unsigned int generation, const boost::system::error_code& err)
+    {
+        if (generation != m_generation || m_stopped) return;
+        if (err) {
+            boost::system::error_code e;
+            m_socket.close(e);
+            ++m_generation;
+            Time now = boost::posix_time::microsec_clock::universal_time();
+            if (m_down_since.is_not_a_date_time()) m_down_since = now;
+            if (now - m_down_since >= m_options.connect_timeout) fail_queue(err);
+            reconnect();
+            return;
+        }
+        boost::system::error_code e;
+        m_socket.set_option(boost::asio::ip::tcp::no_delay(true), e);
+        m_connected  = true;
+        m_backoff    = m_options.reconnect_min;
+        m_down_since = Time();
+        read();
+        write();
+    }
+
+    // Connect again after a delay, the next delay is longer.
+    void reconnect()
+    {
+        m_timer.expires_from_now(m_backoff);
+        m_timer.async_wait(m_strand.wrap(
+            boost::bind(&KvConnection::on_timer, shared_from_this(), _1)));
+        m_backoff = std::min(m_backoff * 2, m_options.reconnect_max);
+    }
+
+    void on_timer(const boost::system::error_code& err)
+    {
+        if (err || m_stopped) return;
+        connect();
+    }
+
+    // Write all queued requests in one buffer, unless it is being written.
+    void write()
+    {
+        if (!m_connected || m_writing) return;
+        m_output.clear();
+        while (!m_queue.empty() && m_sent.size() < m_options.pipeline) {
+            m_output += m_queue.front().frame;
+            m_sent.push_back(std::move(m_queue.front().handler));
+            m_queue.pop_front();
+        }
+        if (m_output.empty()) return;
+        m_writing = true;
+        boost::asio::async_write(m_socket, boost::asio::buffer(m_output), m_strand.wrap(
+            boost::bind(&KvConnection::on_write, shared_from_this(), m_generation, _1)));
+    }
+
+    void on_write(unsigned int generation, const boost::system::error_code& err)
+    {
+        if (generation != m_generation) return;
+        m_writing = false;
+        if (err) return broken(err);
+        write();
+    }
+
+    void read()
+    {
+        if (m_input.size() - m_input_size < 16 * 1024) m_input.resize(m_input_size + 64 * 1024);
+        auto buf = boost::asio::buffer(m_input.data() + m_input_size, m_input.size() - m_input_size);
+        m_socket.async_read_some(buf, m_strand.wrap(
+            boost::bind(&KvConnection::on_read, shared_from_this(), m_generation, _1, _2)));
+    }
+
+    void on_read(unsigned int generation, const boost::system::error_code& err, std::size_t bytes)
+    {
+        if (generation != m_generation) return;
+        if (err) return broken(err);
+        m_input_size += bytes;
+
+        std::size_t pos = 0;
+        while (m_input_size - pos >= protocol::response_header_size) {
+            protocol::ResponseHeader h;
+            protocol::decode(h, m_input.data() + pos);
+            if (h.status == protocol::StatusBusy)
+                return broken(boost::system::errc::make_error_code(boost::system::errc::resource_unavailable_try_again));
+            // Server sends no answer longer than max_batch_length, MGET too.
+            if (m_sent.empty() || h.length > protocol::max_batch_length)
+                return broken(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+            std::size_t frame_size = protocol::response_header_size + h.length;
+            if (m_input_size - pos < frame_size) {
+                if (m_input.size() - pos < frame_size) m_input.resize(pos + frame_size);
+                break;
+            }
+            m_result.status  = h.status;
+            m_result.flags   = h.flags;
+            m_result.version = h.version;
+            boost::string_view payload(m_input.data() + pos + protocol::response_header_size, h.length);
+            if (h.flags & protocol::ResponseCompressed) {
+                if (!protocol::uncompress_value(payload, m_result.payload))
+                    return broken(boost::system::errc::make_error_code(boost::system::errc::protocol_error));
+                m_result.flags &= ~protocol::ResponseCompressed;
+            }
+            else {
+                m_result.payload.append(payload.data(), payload.size());
+            }
+            pos += frame_size;
+            // Frames of one answer go on.
+            if (h.flags & protocol::ResponseMore) continue;
+
+            KvHandler handler = std::move(m_sent.front());
+            m_sent.pop_front();
+            KvResult result = std::move(m_result);
+            m_result = KvResult();
+            --m_load;
+            if (handler) handler(std::move(result));
+            if (generation != m_generation) return;     // Handler stopped us
+        }
+        if (pos) {
+            std::memmove(m_input.data(), m_input.data() + pos, m_input_size - pos);
+            m_input_size -= pos;
+        }
+        write();
+        read();
+    }
+
+    // Connection is lost: requests written to it fail, the others wait.
+    void broken(const boost::system::error_code& err)
+    {
+        disconnect();
+        fail_sent(err);
+        if (!m_stopped) reconnect();
+    }
+
+    void disconnect()
+    {
+        boost::system::error_code e;
+        m_socket.close(e);
+        ++m_generation;
+        m_connected  = false;
+        m_writing    = false;
+        m_input_size = 0;
+        m_result     = KvResult();
+    }
+
+    void fail_sent(const boost::system::error_code& err)
+    {
+        std::deque<KvHandler> sent;
+        sent.swap(m_sent);
+        for (auto& handler : sent) complete(handler, err);
+    }
+
+    void fail_queue(const boost::system::error_code& err)
+    {
+        std::deque<Request> queue;
+        queue.swap(m_queue);
+        for (auto& r : queue) complete(r.handler, err);
+    }
+
+    void complete(KvHandler& handler, const boost::system::error_code& err)
+    {
+        --m_load;
+        KvResult result;
+        result.error = err;
+        if (handler) handler(std::move(result));
+    }
+};
+
+//-----------------------------------------------------------------------------
+// KvClient - pool of connections to one server
+//-----------------------------------------------------------------------------
+
+class KvClient
+{
+    boost::asio::io_service&                     m_service;
+    KvClientOptions                              m_options;
+    std::vector<boost::shared_ptr<KvConnection>> m_pool;
+    std::atomic<unsigned int>                    m_next{0};
+
+public:
+    KvClient(boost::asio::io_service& service, const KvClientOptions& options = KvClientOptions()) :
+        m_service(service),
+        m_options(options)
+    {
+        auto endpoint = boost::asio::ip::tcp::endpoint(
+            boost::asio::ip::address::from_string(options.address), options.port);
+        for (unsigned int i = 0; i < std::max(1u, options.connections); ++i)
+            m_pool.push_back(boost::make_shared<KvConnection>(service, endpoint, m_options));
+    }
+
+    ~KvClient() { stop(); }
+
+    KvClient(const KvClient&) = delete;
+    KvClient& operator=(const KvClient&) = delete;
+
+    const KvClientOptions& options() const { return m_options; }
+
+    // Connect all connections of pool, requests may be sent before it.
+    void start()
+    {
+        for (auto& c : m_pool) c->start();
+    }
+
+    // Close all connections, requests not answered yet fail. When there is
+    // no other work the io_service returns.
+    void stop()
+    {
+        for (auto& c : m_pool) c->stop();
+    }
+
+    // Request of any command, payload follows the header.
+    void async_call(const protocol::RequestHeader& h, boost::string_view payload, KvHandler handler)
+    {
+        if (!protocol::valid_request(h) || payload.size() != protocol::payload_length(h)) {
+            KvResult result;
+            result.error = boost::asio::error::invalid_argument;
+            m_service.post([handler, result] { if (handler) handler(result); });
+            return;
+        }
+        std::string frame(protocol::request_header_size, '\0');
+        protocol::encode(h, &frame[0]);
+        frame.append(payload.data(), payload.size());
+        connection().send(std::move(frame), std::move(handler));
+    }
+
+    // INSERT, UPDATE, DELETE, GET, STATS.
+    // CAS and CDELETE with value of CasParams, see async_cas().
+    void async_call(std::uint8_t opcode, boost::string_view key, boost::string_view value, KvHandler handler)
+    {
+        protocol::RequestHeader h;
+        h.opcode       = opcode;
+        h.flags        = opcode == protocol::OpGet && m_options.compression ? protocol::RequestCompressed : 0;
+        h.key_length   = (std::uint16_t)std::min<std::size_t>(key.size(), 0xffff);
+        h.value_length = (std::uint32_t)value.size();
+        std::string payload;
+        payload.reserve(key.size() + value.size());
+        payload.append(key.data(), key.size()).append(value.data(), value.size());
+        async_call(h, payload, std::move(handler));
+    }
+
+    // INSERT, UPDATE and CAS with TTL of key in seconds, 0 - never expires.
+    void async_call(std::uint8_t opcode, boost::string_view key, boost::string_view value, 
+                    std::uint32_t ttl, KvHandler handler)
+    {
+        std::string ttl_value = expire_value(ttl);
+        protocol::RequestHeader h;
+        h.opcode       = opcode;
+        h.flags        = protocol::RequestTtl;
+        h.key_length   = (std::uint16_t)std::min<std::size_t>(key.size(), 0xffff);
+        h.value_length = (std::uint32_t)(ttl_value.size() + value.size());
+        std::string payload;
+        payload.reserve(key.size() + h.value_length);
+        payload.append(key.data(), key.size()).append(ttl_value).append(value.data(), value.size());
+        async_call(h, payload, std::move(handler));
+    }
+
+    // MGET, MDELETE (values are empty) and MSET. Payload of answer is
+    // BatchResultHeader and value of every item.
+    void async_batch(std::uint8_t opcode, const std::vector<protocol::BatchItem>& items, KvHandler handler)
+    {
+        protocol::RequestHeader h;
+        h.opcode = opcode;
+        h.key_length = (std::uint16_t)std::min<std::size_t>(items.size(), 0xffff);
+        std::string payload;
+        for (auto& item : items) {
+            protocol::BatchItemHeader ih;
+            ih.key_length   = (std::uint16_t)item.key.size();
+            ih.value_length = (std::uint32_t)item.value.size();
+            char buf[protocol::batch_item_size];
+            protocol::encode(ih, buf);
+            payload.append(buf, sizeof(buf));
+            payload.append(item.key.data(), item.key.size()).append(item.value.data(), item.value.size());
+        }
+        h.value_length = (std::uint32_t)payload.size();
+        async_call(h, payload, std::move(handler));
+    }
+
+    // SCAN from key or PREFIX of key, limit 0 - no limit, cursor - the last
+    // key received before. Payload of answer is BatchItemHeader, key and
+    // value of every item, ResponseTruncated flag tells the limit is reached.
+    void async_scan(std::uint8_t opcode, boost::string_view key, std::uint32_t limit,
+                    boost::string_view cursor, KvHandler handler)
+    {
+        protocol::ScanParams params;
+        params.limit = limit;
+        char buf[protocol::scan_params_size];
+        protocol::encode(params, buf);
+        std::string value(buf, sizeof(buf));
+        value.append(cursor.data(), cursor.size());
+        async_call(opcode, key, value, std::move(handler));
+    }
+
+    // CAS: value is set when the key has the expected version, version 0
+    // expects no key. CDELETE: key is deleted when it has the expected
+    // version. On StatusConflict the result holds the current version.
+    void async_cas(boost::string_view key, std::uint64_t version, boost::string_view value, KvHandler handler)
+    {
+        async_call(protocol::OpCas, key, cas_value(version, value), std::move(handler));
+    }
+
+    void async_cas(boost::string_view key, std::uint64_t version, boost::string_view value, 
+                   std::uint32_t ttl, KvHandler handler)
+    {
+        async_call(protocol::OpCas, key, cas_value(version, value), ttl, std::move(handler));
+    }
+
+    void async_cdelete(boost::string_view key, std::uint64_t version, KvHandler handler)
+    {
+        async_call(protocol::OpCDelete, key, cas_value(version, boost::string_view()), std::move(handler));
+    }
+
+    // EXPIRE: new TTL of key in seconds, 0 - the key never expires.
+    void async_expire(boost::string_view key, std::uint32_t ttl, KvHandler handler)
+    {
+        async_call(protocol::OpExpire, key, expire_value(ttl), std::move(handler));
+    }
+
+    // Synchronous versions wait for the answer.
+    KvResult call(std::uint8_t opcode, boost::string_view key, boost::string_view value)
+    {
+        return wait([&](KvHandler h) { async_call(opcode, key, value, std::move(h)); });
+    }
+
+    KvResult call(std::uint8_t opcode, boost::string_view key, boost::string_view value, std::uint32_t ttl)
+    {
+        return wait([&](KvHandler h) { async_call(opcode, key, value, ttl, std::move(h)); });
+    }
+
+    KvResult batch(std::uint8_t opcode, const std::vector<protocol::BatchItem>& items)
+    {
+        return wait([&](KvHandler h) { async_batch(opcode, items, std::move(h)); });
+    }
+
+    KvResult scan(std::uint8_t opcode, boost::string_view key, std::uint32_t limit, boost::string_view cursor)
+    {
+        return wait([&](KvHandler h) { async_scan(opcode, key, limit, cursor, std::move(h)); });
+    }
+
+    KvResult cas(boost::string_view key, std::uint64_t version, boost::string_view value)
+    {
+        return wait([&](KvHandler h) { async_cas(key, version, value, std::move(h)); });
+    }
+
+    KvResult cdelete(boost::string_view key, std::uint64_t version)
+    {
+        return wait([&](KvHandler h) { async_cdelete(key, version, std::move(h)); });
+    }
+
+    KvResult expire(boost::string_view key, std::uint32_t ttl)
+    {
+        return wait([&](KvHandler h) { async_expire(key, ttl, std::move(h)); });
+    }
+
+private:
+    static std::string cas_value(std::uint64_t version, boost::string_view value)
+    {
+        protocol::CasParams params;
+        params.version = version;
+        char buf[protocol::cas_params_size];
+        protocol::encode(params, buf);
+        std::string result(buf, sizeof(buf));
+        result.append(value.data(), value.size());
+        return result;
+    }
+
+    static std::string expire_value(std::uint32_t ttl)
+    {
+        protocol::TtlParams params;
+        params.ttl = ttl;
+        char buf[protocol::ttl_params_size];
+        protocol::encode(params, buf);
+        return std::string(buf, sizeof(buf));
+    }
+
+    // The least loaded connection, ties are shared in turn.
+    KvConnection& connection()
+    {
+        std::size_t first = m_next++ % m_pool.size();
+        std::size_t best  = first;
+        for (std::size_t i = 1; i < m_pool.size(); ++i) {
+            std::size_t c = (first + i) % m_pool.size();
+            if (m_pool[c]->load() < m_pool[best]->load()) best = c;
+        }
+        return *m_pool[best];
+    }
+
+    template<typename F>
+    KvResult wait(F send)
+    {
+        auto promise = std::make_shared<std::promise<KvResult>>();
+        auto future  = promise->get_future();
+        send([promise](KvResult result) { promise->set_value(std::move(result)); });
+        return future.get();
+    }
+};
+
+#endif // TCP_TEST_KV_CLIENT_H
@@ -0,0 +1,123 @@
+// KvClientTest.cpp
+// Test of the client library against a running server.
+//
+// MGET of several large values: the answer of server is up to
+// protocol::max_batch_length bytes, the client must read it whole. Values
+// which do not fit come as StatusTooLarge and are taken by GET.
+//
+// TTL near the 32-bit limit: the key stays, expiry time does not wrap
+// around to the past.
+//
+// Usage: kvclienttest <address> <port>, exit code 0 when all checks pass.
+// kvclient_test.sh runs it against a fresh testserver.
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "KvClient.h"
+
+int failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (ok) return;
+    ++failures;
+    std::cerr << "FAILED: " << what << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        std::cout << "Using: kvclienttest <address> <port>" << std::endl;
+        return 2;
+    }
+    KvClientOptions options;
+    options.address = argv[1];
+    options.port    = (unsigned short)std::stoul(argv[2]);
+
+    boost::asio::io_service       service;
+    boost::asio::io_service::work work(service);
+    std::thread                   runner([&service] { service.run(); });
+    KvClient                      client(service, options);
+    client.start();
+
+    // Random values do not compress: the answer takes their full size,
+    // more than max_batch_length for all of them together.
+    const std::size_t        count = 20;
+    std::mt19937             random(1);
+    std::vector<std::string> keys, values;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::string value(protocol::max_value_length, '\0');
+        for (auto& c : value) c = (char)random();
+        keys.push_back("kvclienttest" + std::to_string(i));
+        values.push_back(value);
+        client.call(protocol::OpDelete, keys.back(), boost::string_view());
+        check(client.call(protocol::OpInsert, keys.back(), values.back()).ok(), "INSERT " + keys.back());
+    }
+    keys.push_back("kvclienttest.small");
+    values.push_back("small value");
+    client.call(protocol::OpDelete, keys.back(), boost::string_view());
+    check(client.call(protocol::OpInsert, keys.back(), values.back()).ok(), "INSERT " + keys.back());
+
+    std::vector<protocol::BatchItem> items;
+    for (auto& key : keys) items.push_back(protocol::BatchItem{ key, boost::string_view() });
+    KvResult r = client.batch(protocol::OpMGet, items);
+    check(r.ok(), "MGET: " + (r.error ? r.error.message() : std::string(protocol::status_name(r.status))));
+    check(r.payload.size() <= protocol::max_batch_length, "MGET answer is within max_batch_length");
+
+    std::size_t got = 0, too_large = 0;
+    const char* p   = r.payload.data();
+    const char* end = p + r.payload.size();
+    for (std::size_t i = 0; r.ok() && i < keys.size(); ++i) {
+        protocol::BatchResultHeader rh;
+        if ((std::size_t)(end - p) < protocol::batch_result_size) {
+            check(false, "MGET answer has results of all keys");
+            break;
+        }
+        p = protocol::decode(rh, p);
+        if ((std::size_t)(end - p) < rh.length) {
+            check(false, "MGET answer has values of all keys");
+            break;
+        }
+        if (rh.status == protocol::StatusOk) {
+            check(std::string(p, rh.length) == values[i], "MGET value of " + keys[i]);
+            ++got;
+        }
+        else if (rh.status == protocol::StatusTooLarge) {
+            KvResult g = client.call(protocol::OpGet, keys[i], boost::string_view());
+            check(g.ok() && g.payload == values[i], "GET value of " + keys[i] + " after TOO_LARGE");
+            ++too_large;
+        }
+        else {
+            check(false, "MGET status of " + keys[i] + ": " + protocol::status_name(rh.status));
+        }
+        p += rh.length;
+    }
+    check(got > 1, "MGET gives several large values");
+    check(too_large > 0, "MGET leaves out values over max_batch_length");
+
+    for (auto& key : keys) client.call(protocol::OpDelete, key, boost::string_view());
+
+    const std::uint32_t long_ttl = 0xfffffff0;
+    const std::string   ttl_key  = "kvclienttest.ttl";
+    client.call(protocol::OpDelete, ttl_key, boost::string_view());
+    check(client.call(protocol::OpInsert, ttl_key, "long ttl", long_ttl).ok(), "INSERT with TTL 0xfffffff0");
+    check(client.call(protocol::OpGet, ttl_key, boost::string_view()).ok(), "GET after INSERT with TTL 0xfffffff0");
+    check(client.expire(ttl_key, 0).ok() && client.expire(ttl_key, long_ttl).ok(), "EXPIRE with TTL 0xfffffff0");
+    check(client.call(protocol::OpGet, ttl_key, boost::string_view()).ok(), "GET after EXPIRE with TTL 0xfffffff0");
+    client.call(protocol::OpDelete, ttl_key, boost::string_view());
+    client.stop();
+    service.stop();
+    runner.join();
+
+    std::cout << "MGET of " << keys.size() << " keys: " << got << " values in " << r.payload.size() 
+              << " bytes, " << too_large << " too large." << std::endl;
+    if (failures) return 1;
+    std::cout << "All checks passed." << std::endl;
+    return 0;
+}
@@ -1,40 +1,41 @@
 // TestClient.cpp 
 //
+// testclient [ip[:port]] <COMMAND> ...  - sends one command;
+// testclient [ip[:port]] -              - sends commands of stdin, one per line,
+//                                  over one connection without waiting for
+//                                  answers (see KvClient.h).
 
 #include <fstream>
 #include <iostream>
 #include <cstdlib> 
 #include <cstring>
 #include <ctime>
+#include <functional>
 #include <string>
+#include <vector>
 #include <stdio.h>
 
-#include <boost/thread.hpp>
-#include <boost/bind.hpp>
 #include <boost/asio.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/enable_shared_from_this.hpp>
-#include <boost/scoped_ptr.hpp>
-#include <boost/chrono.hpp>
 #include <boost/regex.hpp>
+#include <boost/tokenizer.hpp>
 
-#include <boost/date_time/posix_time/posix_time.hpp>
-#include <boost/date_time/local_time/local_time.hpp>
+#include "Protocol.h"
+#include "KvClient.h"
 
 #if !defined(WIN32) and !defined(WINDOWS)
 #   define sprintf_s  snprintf
 #endif
 
 using namespace boost::asio;
-using namespace boost::posix_time;
 
 bool test_ip_adress(const std::string& s, std::string* ip)
 {
-    if (s == "localhost") {
-        if (ip) *ip = "127.0.0.1";
+    if (s == "localhost" || s.compare(0, 10, "localhost:") == 0) {
+        if (ip) *ip = "127.0.0.1" + s.substr(9);
         return true;
     }
-    boost::regex  pattern("(\\d{1,3}(\\.\\d{1,3}){3})");
+    // Port may follow the address.
+    boost::regex  pattern("(\\d{1,3}(\\.\\d{1,3}){3}(:\\d{1,5})?)");
     boost::smatch match;
     if (!boost::regex_search(s, match, pattern)) return false;
     if (ip) *ip = match[1];
@@ -43,17 +44,22 @@ bool test_ip_adress(const std::string& s, std::string* ip)
 
 bool test_command(const std::string& s, std::string* cmd)
 {
-    std::string c = s;
-    std::transform(c.begin(), c.end(), c.begin(), toupper);
-    if (c == "INSERT" ||
-        c == "UPDATE" ||
-        c == "DELETE" ||
-        c == "GET")
-    {
-        if (cmd) *cmd = c;
-        return true;
-    }
-    return false;
+    auto op = protocol::opcode_by_name(s);
+    if (!op) return false;
+    if (cmd) *cmd = protocol::opcode_name(op);
+    return true;
+}
+
+// Decimal number of at most digits.
+bool test_number(const std::string& s, std::size_t digits)
+{
+    return !s.empty() && s.length() <= digits && s.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// TTL in seconds, any 32-bit number: server limits the expiry time itself.
+bool test_ttl(const std::string& s)
+{
+    return test_number(s, 10) && std::stoull(s) <= 0xffffffffULL;
 }
 
 bool test_command_string(
@@ -62,12 +68,14 @@ bool test_command_string(
     std::string& adress,
     std::string& command,
     std::string& key,
-    std::string& value)
+    std::string& value,
+    std::vector<std::string>& items)
 {
     adress = "127.0.0.1";
     command = "INSERT";
     key = "";
     value = "";
+    items.clear();
 
     int i = 1;
     while (i < argc) {
@@ -85,16 +93,37 @@ bool test_command_string(
                 continue;
             }
         }
+        // Batch command takes all the rest: keys, or keys and values.
+        // SCAN and PREFIX take start key or prefix, limit and cursor.
+        auto op = protocol::opcode_by_name(command);
+        if (argc > i && (protocol::is_batch(op) || protocol::is_scan(op))) {
+            items.push_back(argv[i]);
+            ++i;
+            continue;
+        }
         if (argc > i && !key.length()) {
             key = argv[i];
             ++i;
             continue;
         }
+        // CAS and CDELETE take the expected version after key, EXPIRE - TTL.
+        if (argc > i && (op == protocol::OpCas || op == protocol::OpCDelete || op == protocol::OpExpire) && items.empty()) {
+            items.push_back(argv[i]);
+            ++i;
+            continue;
+        }
         if (argc > i && !value.length()) {
             value = argv[i];
             ++i;
             continue;
         }
+        // INSERT, UPDATE and CAS take TTL in seconds after value.
+        if (argc > i && (op == protocol::OpInsert || op == protocol::OpUpdate || op == protocol::OpCas) && 
+            items.size() == (op == protocol::OpCas ? 1u : 0u)) {
+            items.push_back(argv[i]);
+            ++i;
+            continue;
+        }
         break;
     }
     if (command == "GET" || command == "DELETE") {
@@ -102,126 +131,201 @@ bool test_command_string(
     }
     if (command == "INSERT" || command == "UPDATE") {
         if (!value.length() || !key.length()) return false;
+        if (items.size() && !test_ttl(items[0])) return false;
+    }
+    if (command == "STATS") {
+        if (value.length() || key.length()) return false;
+    }
+    // Answer to SYNC never ends, it is for replicas only.
+    if (command == "SYNC") return false;
+    if (command == "CAS" || command == "CDELETE") {
+        if (!key.length() || items.empty()) return false;
+        if (!test_number(items[0], 19)) return false;
+        if (command == "CAS" && !value.length()) return false;
+        if (command == "CAS" && items.size() > 1 && !test_ttl(items[1])) return false;
+        if (command == "CDELETE" && value.length()) return false;
+    }
+    if (command == "EXPIRE") {
+        if (!key.length() || value.length() || items.size() != 1 || !test_ttl(items[0])) return false;
+    }
+    if (protocol::is_batch(protocol::opcode_by_name(command))) {
+        if (items.empty() || items.size() > protocol::max_batch_items) return false;
+        if (command == "MSET" && items.size() % 2) return false;
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            bool is_key = command != "MSET" || i % 2 == 0;
+            if (is_key && (!items[i].length() || items[i].length() > protocol::max_key_length)) return false;
+            if (items[i].length() > protocol::max_value_length) return false;
+        }
+    }
+    if (protocol::is_scan(protocol::opcode_by_name(command))) {
+        if (items.size() > 3 || (command == "PREFIX" && items.empty())) return false;
+        for (auto& item : items)
+            if (item.length() > protocol::max_key_length) return false;
+        if (items.size() > 1 && items[1].find_first_not_of("0123456789") != std::string::npos) return false;
+        if (items.size() > 1 && (items[1].empty() || items[1].length() > 9)) return false;
     }
+    if (key.length()   > protocol::max_key_length)   return false;
+    if (value.length() > protocol::max_value_length) return false;
 
     return true;
 }
 
-ptime        start_time      = second_clock::local_time();
-unsigned int max_durations   = 30;
 const char   server_def_ip[] = "127.0.0.1";
 const int    server_port     = 31415;
 io_service   service;
 
-std::ostream& operator << (std::ostream& stream, const boost::system::error_code& err)
+// Command of command line or of a line of stdin.
+struct Command {
+    std::string command;
+    std::string key;
+    std::string value;
+    // Keys, or keys and values of batch command; start key, limit and
+    // cursor of SCAN and PREFIX; expected version of CAS and CDELETE;
+    // TTL of INSERT, UPDATE, EXPIRE and, after version, of CAS.
+    std::vector<std::string> items;
+};
+
+// Keys and values of answer of SCAN or PREFIX.
+std::string scan_text(const Command& c, const KvResult& r)
 {
-    return stream
-        << err.category().name()
-        << " message: "
-        << err.message() << std::endl;
+    std::string text;
+    std::string last;
+    std::size_t count = 0;
+    const char* p   = r.payload.data();
+    const char* end = p + r.payload.size();
+    while (p != end) {
+        protocol::BatchItemHeader ih;
+        if ((std::size_t)(end - p) < protocol::batch_item_size) return text + "\n    invalid answer";
+        p = protocol::decode(ih, p);
+        if ((std::size_t)(end - p) < (std::size_t)ih.key_length + ih.value_length) return text + "\n    invalid answer";
+        last.assign(p, ih.key_length);
+        text += "\n    \"" + last + "\": \"" + std::string(p + ih.key_length, ih.value_length) + "\"";
+        p += ih.key_length + ih.value_length;
+        ++count;
+    }
+    text = "Command " + c.command + " is executed, " + std::to_string(count) + " items:" + text;
+    if (r.flags & protocol::ResponseTruncated) {
+        text += "\nLimit is reached, continue with: testclient " + c.command + " \"" + c.items[0] +
+            "\" " + c.items[1] + " \"" + last + "\"";
+    }
+    return text;
 }
 
-class TestClient : public boost::enable_shared_from_this<TestClient>
+// Status of every key of batch, and value for MGET.
+std::string batch_text(const Command& c, const KvResult& r)
 {
-    std::string      m_adress = server_def_ip;
-    std::string      m_command = "";
-    std::string      m_key = "";
-    std::string      m_value = "";
-    ip::tcp::socket  m_socket;
-    static const int m_message_length = 3072;
-    char             m_write_buf[m_message_length];
-
-public:
-    TestClient(
-        const std::string& adress,
-        const std::string& command,
-        const std::string& key,
-        const std::string& value) :
-        m_adress(adress),
-        m_command(command),
-        m_key(key),
-        m_value(value),
-        m_socket(service)
-    {
+    std::string text = "Command " + c.command + " is executed:";
+    std::size_t step = c.command == "MSET" ? 2 : 1;
+    const char* p    = r.payload.data();
+    const char* end  = p + r.payload.size();
+    for (std::size_t i = 0; i < c.items.size(); i += step) {
+        protocol::BatchResultHeader rh;
+        if ((std::size_t)(end - p) < protocol::batch_result_size) return text + "\n    invalid answer";
+        p = protocol::decode(rh, p);
+        if ((std::size_t)(end - p) < rh.length) return text + "\n    invalid answer";
+        text += "\n    \"" + c.items[i] + "\": " + protocol::status_name(rh.status);
+        if (c.command == "MGET" && rh.status == protocol::StatusOk)
+            text += " value = \"" + std::string(p, rh.length) + "\"";
+        p += rh.length;
     }
+    return text;
+}
 
-    void start()
-    {
-        std::cout << "Test client started..." << std::endl;
-        connect();
+std::string answer_text(const Command& c, const KvResult& r)
+{
+    if (r.error) return "Command " + c.command + " is failed: " + r.error.message();
+    switch (r.status) {
+    case protocol::StatusOk:
+        if (protocol::is_scan(protocol::opcode_by_name(c.command))) return scan_text(c, r);
+        if (protocol::is_batch(protocol::opcode_by_name(c.command))) return batch_text(c, r);
+        if (c.command == "STATS") return "Statistics of server:\n" + r.payload;
+        if (c.command == "GET") return "Get is successful: key = \"" + c.key + "\" value = \"" + r.payload + 
+                                       "\" version = " + std::to_string(r.version);
+        if (r.version) return "Command " + c.command + " is successful execute, version = " + std::to_string(r.version) + ".";
+        return "Command " + c.command + " is successful execute.";
+    case protocol::StatusExists:
+        return "An entry with the \"" + c.key + "\" key already exists, version = " + std::to_string(r.version) + ".";
+    case protocol::StatusUnchanged:
+        return "An entry with the \"" + c.key + "\" key already has this value.";
+    case protocol::StatusReadOnly:
+        return "Server is a replica, command " + c.command + " is rejected.";
+    case protocol::StatusConflict:
+        return "An entry with the \"" + c.key + "\" key has another version = " + std::to_string(r.version) + ".";
+    case protocol::StatusNotFound:
+        return "An entry with the \"" + c.key + "\" key is not found.";
+    case protocol::StatusBadRequest:
+        return "Command " + c.command + " is rejected by server.";
     }
+    return "Command " + c.command + " is failed execute.";
+}
 
-    void connect()
-    {
-        auto endpoint = ip::tcp::endpoint(ip::address::from_string(m_adress), server_port);
-        auto binder = boost::bind(&TestClient::on_connect, shared_from_this(), _1);
-        m_socket.async_connect(endpoint, binder);
-    }
+// Send command, the answer is printed when it comes.
+void send_command(KvClient& client, const Command& c, const std::function<void()>& done)
+{
+    std::cout << "Sent to server:     " << c.command << "\t" << c.key;
+    if (c.value.length()) std::cout << "\t" << c.value;
+    for (auto& item : c.items) std::cout << "\t" << item;
+    std::cout << std::endl;
 
-    void on_connect(const boost::system::error_code& err)
-    {
-        if (err) {
-            ptime current_time = second_clock::local_time();
-            auto sec = (current_time - start_time).seconds();
-            if (sec > max_durations) {
-                std::cout << "Connection error: " << err << std::endl;
-                close();
-                return;
-            }
-            std::cout << "Unsuccessful attempt to connect to the server. Retry connection..." << std::endl;
-            boost::chrono::milliseconds period(1000);
-            boost::this_thread::sleep_for(period);
-            connect();
-            return;
+    auto handler = [c, done](KvResult r) {
+        std::cout << "Answer from server: " << answer_text(c, r) << std::endl;
+        done();
+    };
+    auto op = protocol::opcode_by_name(c.command);
+    if (protocol::is_batch(op)) {
+        std::vector<protocol::BatchItem> items;
+        std::size_t step = op == protocol::OpMSet ? 2 : 1;
+        for (std::size_t i = 0; i < c.items.size(); i += step) {
+            protocol::BatchItem item;
+            item.key = c.items[i];
+            if (step == 2) item.value = c.items[i + 1];
+            items.push_back(item);
         }
-        write();
+        client.async_batch(op, items, handler);
     }
-
-    void close()
-    {
-        if (!m_socket.is_open()) return;
-        std::cout << "Client close." << std::endl;
-        m_socket.close();
+    else if (protocol::is_scan(op)) {
+        std::uint32_t limit = c.items.size() > 1 ? (std::uint32_t)std::stoul(c.items[1]) : 0;
+        client.async_scan(op, c.items.size() ? c.items[0] : std::string(),
+                          limit, c.items.size() > 2 ? c.items[2] : std::string(), handler);
     }
+    else if (op == protocol::OpCas && c.items.size() > 1) 
+        client.async_cas(c.key, std::stoull(c.items[0]), c.value, (std::uint32_t)std::stoul(c.items[1]), handler);
+    else if (op == protocol::OpCas) client.async_cas(c.key, std::stoull(c.items[0]), c.value, handler);
+    else if (op == protocol::OpCDelete) client.async_cdelete(c.key, std::stoull(c.items[0]), handler);
+    else if (op == protocol::OpExpire) client.async_expire(c.key, (std::uint32_t)std::stoul(c.items[0]), handler);
+    else if (c.items.size()) client.async_call(op, c.key, c.value, (std::uint32_t)std::stoul(c.items[0]), handler);
+    else client.async_call(op, c.key, c.value, handler);
+}
 
-    void write()
-    {
-        std::string s = m_command + "\n" + m_key;
-        if (m_value.length()) s += "\n" + m_value;
-        sprintf_s(m_write_buf, m_message_length, "%s", s.c_str());
-
-        auto buf = buffer(m_write_buf, m_message_length);
-        auto hnd = boost::bind(&TestClient::on_write, shared_from_this(), _1);
-
-        async_write(m_socket, buf, hnd);
+// Commands of stdin, one per line as in command line. Words are separated
+// by spaces, "quoted words" may contain them. Empty lines and lines
+// starting with # are skipped, so are invalid ones.
+std::vector<Command> read_commands(std::istream& in)
+{
+    std::vector<Command> commands;
+    std::string line;
+    for (unsigned int n = 1; std::getline(in, line); ++n) {
+        if (line.length() && line.back() == '\r') line.pop_back();
+        if (line.find_first_not_of(" \t") == std::string::npos || line[line.find_first_not_of(" \t")] == '#') continue;
 
-        std::replace(s.begin(), s.end(), '\n', '\t');
-        std::cout << "Sent to server:     " << s << std::endl;
-    }
+        std::vector<std::string> words = { "testclient" };
+        boost::tokenizer<boost::escaped_list_separator<char>> tokens(
+            line, boost::escaped_list_separator<char>('\\', ' ', '"'));
+        for (auto& w : tokens)
+            if (w.length()) words.push_back(w);
+        std::vector<char*> argv;
+        for (auto& w : words) argv.push_back(&w[0]);
 
-    void on_write(const boost::system::error_code& err)
-    {
-        if (err) {
-            std::cout << "Write error: " << err << std::endl;
-            close();
-            return;
+        Command c;
+        std::string adress;
+        if (!test_command_string((int)argv.size(), argv.data(), adress, c.command, c.key, c.value, c.items)) {
+            std::cout << "Invalid command format in line " << n << ": " << line << std::endl;
+            continue;
         }
-        read_answer();
-    }
-
-    void read_answer()
-    {
-        auto buf = buffer(m_write_buf, m_message_length);
-        auto hnd = boost::bind(&TestClient::on_read_answer, shared_from_this(), _1);
-        async_read(m_socket, buf, hnd);
+        commands.push_back(c);
     }
-
-    void on_read_answer(const boost::system::error_code& err)
-    {
-        if (err) std::cout << "Read answer error: " << err << std::endl;
-        else     std::cout << "Answer from server: " << std::string(m_write_buf) << std::endl;
-    }
-};
+    return commands;
+}
 
 int main(int argc, char* argv[])
 {
@@ -231,27 +335,57 @@ int main(int argc, char* argv[])
 #else
     setlocale(LC_ALL, "Russian");
 #endif
-    std::string adress;
-    std::string command;
-    std::string key;
-    std::string value;
+    std::string adress = server_def_ip;
+    std::vector<Command> commands;
 
-    if (!test_command_string(argc, argv, adress, command, key, value)) {
+    // testclient [ip] - : commands are read from stdin.
+    bool from_stdin = argc > 1 && std::string(argv[argc - 1]) == "-";
+    bool valid = true;
+    if (from_stdin) {
+        valid = argc == 2 || (argc == 3 && test_ip_adress(argv[1], &adress));
+        if (valid) commands = read_commands(std::cin);
+    }
+    else {
+        Command c;
+        valid = test_command_string(argc, argv, adress, c.command, c.key, c.value, c.items);
+        commands.push_back(c);
+    }
+    if (!valid) {
         std::cout << "Invalid command format." << std::endl;
         std::cout << "Using: " << std::endl;
         std::cout << "       testclient <COMMAND> <key string>  <value string>" << std::endl;
-        std::cout << "       Commands: INSERT, UPDATE, DELETE, GET" << std::endl;
+        std::cout << "       testclient INSERT|UPDATE <key string> <value string> <TTL, seconds>" << std::endl;
+        std::cout << "       testclient STATS" << std::endl;
+        std::cout << "       testclient MGET|MDELETE <key string> ..." << std::endl;
+        std::cout << "       testclient MSET <key string> <value string> ..." << std::endl;
+        std::cout << "       testclient SCAN [<start key> [<limit> [<after key>]]]" << std::endl;
+        std::cout << "       testclient PREFIX <prefix> [<limit> [<after key>]]" << std::endl;
+        std::cout << "       testclient CAS <key string> <version, 0 - absent> <value string> [<TTL, seconds>]" << std::endl;
+        std::cout << "       testclient CDELETE <key string> <version>" << std::endl;
+        std::cout << "       testclient EXPIRE <key string> <TTL, seconds, 0 - never>" << std::endl;
+        std::cout << "       testclient -       commands from stdin, one per line" << std::endl;
+        std::cout << "       Commands: INSERT, UPDATE, DELETE, GET, STATS, MGET, MSET, MDELETE, SCAN, PREFIX, CAS, CDELETE, EXPIRE" << std::endl;
         return 0;
     }
-   
-    boost::shared_ptr<TestClient> c = boost::make_shared<TestClient>(
-        adress,
-        command,
-        key,
-        value);
+    if (commands.empty()) return 0;
+
+    KvClientOptions options;
+    auto colon = adress.find(':');
+    options.address = adress.substr(0, colon);
+    options.port    = colon == std::string::npos ? server_port : std::stoi(adress.substr(colon + 1));
+    KvClient client(service, options);
 
-    c->start();
+    // All commands go over one connection without waiting for answers,
+    // the client stops after the last answer.
+    std::size_t answers = 0;
+    std::function<void()> done = [&] {
+        if (++answers == commands.size()) client.stop();
+    };
+    std::cout << "Test client started..." << std::endl;
+    client.start();
+    for (auto& c : commands) send_command(client, c, done);
     service.run();
+    std::cout << "Client close." << std::endl;
 
     return 0;
 }
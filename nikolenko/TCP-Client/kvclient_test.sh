@@ -0,0 +1,19 @@
+#!/bin/sh
+# Run kvclienttest against a fresh testserver on a spare port.
+# Usage: kvclient_test.sh <testserver> <kvclienttest>
+server=$1
+test=$2
+port=31499
+if [ ! -x "$server" ]; then
+    echo "testserver is not built, test is skipped."
+    exit 77
+fi
+dir=$(mktemp -d)
+"$server" -p $port -f "$dir/storage" -w off > "$dir/server.log" 2>&1 &
+pid=$!
+"$test" 127.0.0.1 $port
+result=$?
+kill -INT $pid
+wait $pid
+rm -rf "$dir"
+exit $result
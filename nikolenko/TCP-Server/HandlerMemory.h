@@ -0,0 +1,71 @@
+// HandlerMemory.h
+// Memory of handlers of asynchronous operations, reused by its owner.
+//
+// Every asynchronous operation of asio allocates memory for its handler and
+// frees it before the handler is called. Owner which has one operation in
+// flight at a time, like the loop of session, gives its handlers
+// HandlerAllocator of its HandlerMemory (the handler tells it to asio by
+// get_allocator()): the same block serves all the operations one after
+// another. Heap is used only when the block is busy or too small.
+
+#ifndef TCP_TEST_HANDLER_MEMORY_H
+#define TCP_TEST_HANDLER_MEMORY_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+class HandlerMemory {
+    // Operation of async_write with a strand is about 200 bytes.
+    static const std::size_t m_size = 1024;
+
+    typename std::aligned_storage<m_size>::type m_block;
+    bool                                        m_in_use = false;
+
+public:
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(std::size_t size)
+    {
+        if (!m_in_use && size <= m_size) {
+            m_in_use = true;
+            return &m_block;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* p)
+    {
+        if (p == &m_block) m_in_use = false;
+        else               ::operator delete(p);
+    }
+};
+
+// Allocator of handler on HandlerMemory.
+template<typename T>
+class HandlerAllocator {
+    template<typename U> friend class HandlerAllocator;
+
+    HandlerMemory* m_memory;
+
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory& memory) noexcept : m_memory(&memory) {}
+
+    template<typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : m_memory(other.m_memory) {}
+
+    T* allocate(std::size_t n) { return static_cast<T*>(m_memory->allocate(sizeof(T) * n)); }
+
+    void deallocate(T* p, std::size_t /*n*/) { m_memory->deallocate(p); }
+
+    template<typename U>
+    bool operator==(const HandlerAllocator<U>& other) const noexcept { return m_memory == other.m_memory; }
+    template<typename U>
+    bool operator!=(const HandlerAllocator<U>& other) const noexcept { return m_memory != other.m_memory; }
+};
+
+#endif // TCP_TEST_HANDLER_MEMORY_H
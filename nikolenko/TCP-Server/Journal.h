@@ -0,0 +1,518 @@
+// Journal.h
+// Write-ahead log of storage.
+//
+// Every change of storage (INSERT, UPDATE, DELETE) is appended to the
+// journal before the answer is sent to client. Records are collected in
+// memory and written by one background thread, so one fdatasync covers all
+// records appended by concurrent requests meanwhile (group commit).
+//
+// Journal is a sequence of segment files "<path>.<first LSN>", a new segment
+// is started at every start of server and when the current one is full.
+// Every record carries LSN (log sequence number) and CRC, replay stops at
+// the first damaged record of segment. Record carries the version given to
+// the key by the change and its expiry time, they survive the rebuild of
+// storage.
+//
+// Records are shipped to replicas in the same form: the flusher thread
+// gives every written batch of records to the subscribed feeds, so a
+// replica never gets a change which is not on disk of primary.
+//
+// Error of write or fdatasync makes the journal failed: records since the
+// last durable one are in unknown state, their waiters are told so, and
+// storage accepts no more changes.
+
+#ifndef TCP_TEST_JOURNAL_H
+#define TCP_TEST_JOURNAL_H
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/fusion/include/adapt_struct.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Protocol.h"
+#include "Log.h"
+
+//-----------------------------------------------------------------------------
+// Journal records
+//-----------------------------------------------------------------------------
+
+enum JournalRecordType : std::uint8_t {
+    JournalPut    = 1,  // INSERT and UPDATE: key has the value
+    JournalErase  = 2,  // DELETE: key is absent
+    JournalExpire = 3,  // EXPIRE: key has the expiry time, no value
+};
+
+struct JournalRecordHeader {
+    std::uint32_t crc          = 0;   // CRC-32 of the rest of record
+    std::uint64_t lsn          = 0;
+    std::uint64_t version      = 0;
+    std::uint32_t expire       = 0;   // Seconds since epoch, 0 - never
+    std::uint8_t  type         = 0;
+    std::uint16_t key_length   = 0;
+    std::uint32_t value_length = 0;
+};
+
+BOOST_FUSION_ADAPT_STRUCT(
+    JournalRecordHeader,
+    crc,
+    lsn,
+    version,
+    expire,
+    type,
+    key_length,
+    value_length
+)
+
+const std::size_t journal_header_size = 4 + 8 + 8 + 4 + 1 + 2 + 4;
+
+// Append record of header h (CRC is computed), key and value to out.
+template<typename Buffer>
+void append_record(Buffer& out, JournalRecordHeader h, boost::string_view key, boost::string_view val)
+{
+    h.key_length   = (std::uint16_t)key.size();
+    h.value_length = (std::uint32_t)val.size();
+    std::size_t pos = out.size();
+    out.resize(pos + journal_header_size + key.size() + val.size());
+    char* p = protocol::encode(h, &out[pos]);
+    p = std::copy(key.begin(), key.end(), p);
+    std::copy(val.begin(), val.end(), p);
+
+    boost::crc_32_type crc;
+    crc.process_bytes(&out[pos + 4], out.size() - pos - 4);
+    h.crc = crc.checksum();
+    protocol::encode(h, &out[pos]);
+}
+
+// Take the record at p of buffer up to end. Key and value point into the
+// buffer. Return false when the record is damaged or incomplete.
+inline bool parse_record(const char*& p, const char* end, JournalRecordHeader& h, 
+                         boost::string_view& key, boost::string_view& val)
+{
+    if ((std::size_t)(end - p) < journal_header_size) return false;
+    protocol::decode(h, p);
+    if (h.key_length > protocol::max_key_length || h.value_length > protocol::max_value_length) return false;
+    std::size_t size = journal_header_size + h.key_length + h.value_length;
+    if ((std::size_t)(end - p) < size) return false;
+
+    boost::crc_32_type crc;
+    crc.process_bytes(p + 4, size - 4);
+    if (crc.checksum() != h.crc) return false;
+    key = boost::string_view(p + journal_header_size, h.key_length);
+    val = boost::string_view(p + journal_header_size + h.key_length, h.value_length);
+    p += size;
+    return true;
+}
+
+// Make rename or creation of file in directory of path durable.
+inline void sync_directory_of(const std::string& path)
+{
+    auto dir = boost::filesystem::path(path).parent_path().string();
+    int  fd  = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    ::fsync(fd);
+    ::close(fd);
+}
+
+//-----------------------------------------------------------------------------
+// Sync policy
+//-----------------------------------------------------------------------------
+
+enum class JournalSync {
+    Off,        // No journal
+    Always,     // Answer waits for fdatasync, concurrent requests share it
+    Interval,   // fdatasync every interval, answer does not wait
+    Os,         // Records are written at once, OS decides when to flush them
+};
+
+struct JournalOptions {
+    JournalSync  sync          = JournalSync::Interval;
+    unsigned int interval_ms   = 10;
+    std::size_t  segment_size  = 64 * 1024 * 1024;
+    // Snapshot is made when so many bytes are appended since the last one,
+    // 0 means no snapshots.
+    std::size_t  snapshot_size = 64 * 1024 * 1024;
+};
+
+inline bool journal_sync_by_name(const std::string& name, JournalSync& sync)
+{
+    if      (name == "off")      sync = JournalSync::Off;
+    else if (name == "always")   sync = JournalSync::Always;
+    else if (name == "interval") sync = JournalSync::Interval;
+    else if (name == "os")       sync = JournalSync::Os;
+    else return false;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Journal
+//-----------------------------------------------------------------------------
+
+class Journal {
+    // Argument is false when the records are not durable: journal is failed.
+    typedef std::function<void(bool)> Handler;
+
+public:
+    // Records written to disk, they are given in order by flusher thread.
+    typedef std::shared_ptr<const std::string> Records;
+    typedef std::function<void(const Records&)> Feed;
+
+private:
+    std::string    m_path;
+    JournalOptions m_options;
+
+    std::mutex              m_mtx;
+    std::condition_variable m_cv;
+    std::vector<char>       m_buffer;          // Appended, not written yet
+    std::uint64_t           m_last_lsn    = 0; // Last appended
+    std::uint64_t           m_durable_lsn = 0; // Last written (and synced)
+    std::vector<std::pair<std::uint64_t, Handler>> m_waiters;
+    std::uint64_t           m_appended = 0;    // Bytes appended since open
+    std::condition_variable m_roll_cv;
+    std::uint64_t           m_roll_requests = 0;
+    std::uint64_t           m_rolls_done    = 0;
+    bool                    m_stop = false;
+    std::atomic<bool>       m_failed{false};   // Write or sync error
+
+    std::mutex                        m_feed_mtx;
+    std::map<std::uint64_t, Feed>     m_feeds;
+    std::uint64_t                     m_feed_id = 0;
+
+    // Owned by flusher thread.
+    std::vector<char> m_flushing;
+    // Waiters called after the write, the vector keeps its capacity.
+    std::vector<std::pair<std::uint64_t, Handler>> m_ready;
+    int               m_fd = -1;
+    std::size_t       m_segment_written = 0;
+    std::thread       m_flusher;
+
+public:
+    Journal(const std::string& path, const JournalOptions& options) :
+        m_path(path),
+        m_options(options)
+    {
+    }
+
+    ~Journal()
+    {
+        close();
+    }
+
+    const JournalOptions& options() const { return m_options; }
+
+    // Answers must wait for wait_durable() before they are sent.
+    bool waits_for_sync() const { return m_options.sync == JournalSync::Always; }
+
+    // Journal can not write records any more, changes must be refused.
+    bool failed() const { return m_failed.load(std::memory_order_relaxed); }
+
+    std::uint64_t last_lsn()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_last_lsn;
+    }
+
+    std::uint64_t appended_bytes()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_appended;
+    }
+
+    // Close the current segment, so that it may be removed.
+    // Return when the flusher thread has started the next one.
+    void roll()
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        auto request = ++m_roll_requests;
+        m_cv.notify_all();
+        m_roll_cv.wait(lock, [&] { return m_stop || m_rolls_done >= request; });
+    }
+
+    // First LSN of the oldest segment, 0 when there are no segments.
+    std::uint64_t first_lsn() const
+    {
+        auto files = segments();
+        return files.empty() ? 0 : files.front().first;
+    }
+
+    // Remove segments with records up to lsn only.
+    // The last segment is never removed, it is the one being written.
+    void remove_segments(std::uint64_t lsn)
+    {
+        auto files = segments();
+        std::size_t removed = 0;
+        for (std::size_t i = 0; i + 1 < files.size(); ++i) {
+            if (files[i + 1].first > lsn + 1) break;
+            boost::system::error_code err;
+            boost::filesystem::remove(files[i].second, err);
+            if (!err) ++removed;
+        }
+        if (removed) logger().write(LogLevel::Info, "Journal: %zu segments are removed.", removed);
+    }
+
+    // Call apply(type, key, value, version, expire) for every record with LSN
+    // above from_lsn.
+    // Return the last LSN found in journal.
+    template<typename F>
+    std::uint64_t replay(std::uint64_t from_lsn, F apply)
+    {
+        std::uint64_t last = 0;
+        std::size_t   count = 0;
+        std::vector<char> buf;
+        for (auto& file : segments()) {
+            std::ifstream in(file.second, std::ios::binary);
+            char h_buf[journal_header_size];
+            while (in.read(h_buf, sizeof(h_buf))) {
+                JournalRecordHeader h;
+                protocol::decode(h, h_buf);
+                if (h.key_length > protocol::max_key_length || h.value_length > protocol::max_value_length) break;
+                buf.resize(h.key_length + h.value_length);
+                if (!in.read(buf.data(), buf.size())) break;
+
+                boost::crc_32_type crc;
+                crc.process_bytes(h_buf + 4, journal_header_size - 4);
+                crc.process_bytes(buf.data(), buf.size());
+                if (crc.checksum() != h.crc) break;
+
+                last = std::max(last, h.lsn);
+                if (h.lsn <= from_lsn) continue;
+                apply(h.type,
+                      std::string(buf.data(), h.key_length),
+                      std::string(buf.data() + h.key_length, h.value_length),
+                      h.version, h.expire);
+                ++count;
+            }
+        }
+        if (count) logger().write(LogLevel::Info, "Journal: %llu records are replayed.", (unsigned long long)count);
+        return last;
+    }
+
+    // Start new segment and flusher thread, next record gets next_lsn.
+    bool open(std::uint64_t next_lsn)
+    {
+        m_last_lsn = m_durable_lsn = next_lsn - 1;
+        if (!open_segment(next_lsn)) return false;
+        m_flusher = std::thread([this] { flush_loop(); });
+        return true;
+    }
+
+    // Write everything appended and stop flusher thread.
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        m_roll_cv.notify_all();
+        if (m_flusher.joinable()) m_flusher.join();
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+    }
+
+    // Append record, return its LSN. Thread safe.
+    std::uint64_t append(std::uint8_t type, boost::string_view key, boost::string_view val, 
+                         std::uint64_t version, std::uint32_t expire)
+    {
+        JournalRecordHeader h;
+        h.version      = version;
+        h.expire       = expire;
+        h.type         = type;
+
+        std::lock_guard<std::mutex> lock(m_mtx);
+        h.lsn = ++m_last_lsn;
+        m_appended += journal_header_size + key.size() + val.size();
+        append_record(m_buffer, h, key, val);
+
+        if (m_options.sync != JournalSync::Interval) m_cv.notify_one();
+        return h.lsn;
+    }
+
+    // Feed gets all records appended after the LSN placed to lsn, and maybe
+    // some before it. Return id of subscription.
+    std::uint64_t subscribe(Feed feed, std::uint64_t* lsn)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        std::lock_guard<std::mutex> feed_lock(m_feed_mtx);
+        *lsn = m_last_lsn;
+        m_feeds.emplace(++m_feed_id, std::move(feed));
+        return m_feed_id;
+    }
+
+    // Feed is not called after return, unless it is the caller.
+    void unsubscribe(std::uint64_t id)
+    {
+        std::lock_guard<std::mutex> feed_lock(m_feed_mtx);
+        m_feeds.erase(id);
+    }
+
+    // Call handler(true) when the record lsn is on disk, handler(false)
+    // when the journal fails before it.
+    // Handler may be called from the flusher thread.
+    void wait_durable(std::uint64_t lsn, Handler handler)
+    {
+        bool durable;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            durable = lsn <= m_durable_lsn;
+            if (!durable && !m_failed) {
+                m_waiters.emplace_back(lsn, std::move(handler));
+                return;
+            }
+        }
+        handler(durable);
+    }
+
+private:
+    std::string segment_name(std::uint64_t first_lsn) const
+    {
+        char num[32];
+        std::snprintf(num, sizeof(num), "%020llu", (unsigned long long)first_lsn);
+        return m_path + "." + num;
+    }
+
+    // Segment files ordered by their first LSN.
+    std::vector<std::pair<std::uint64_t, std::string>> segments() const
+    {
+        namespace fs = boost::filesystem;
+        std::vector<std::pair<std::uint64_t, std::string>> result;
+        fs::path base(m_path);
+        fs::path dir = base.has_parent_path() ? base.parent_path() : fs::path(".");
+        std::string prefix = base.filename().string() + ".";
+        boost::system::error_code err;
+        for (fs::directory_iterator it(dir, err), end; !err && it != end; it.increment(err)) {
+            std::string name = it->path().filename().string();
+            if (name.size() != prefix.size() + 20 || name.compare(0, prefix.size(), prefix)) continue;
+            std::string num = name.substr(prefix.size());
+            if (num.find_first_not_of("0123456789") != std::string::npos) continue;
+            result.emplace_back(std::stoull(num), it->path().string());
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    bool open_segment(std::uint64_t first_lsn)
+    {
+        if (m_fd >= 0) ::close(m_fd);
+        auto name = segment_name(first_lsn);
+        // A segment with the same first LSN may only hold a damaged record.
+        m_fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        m_segment_written = 0;
+        if (m_fd < 0) {
+            logger().write(LogLevel::Error, "Journal: can not open \"%s\".", name.c_str());
+            return false;
+        }
+        // New file is durable only together with its directory entry.
+        sync_directory_of(name);
+        return true;
+    }
+
+    void flush_loop()
+    {
+        auto interval = std::chrono::milliseconds(m_options.interval_ms);
+        std::unique_lock<std::mutex> lock(m_mtx);
+        for (;;) {
+            auto roll_requested = [this] { return m_roll_requests != m_rolls_done; };
+            if (m_options.sync == JournalSync::Interval)
+                m_cv.wait_for(lock, interval, [&] { return m_stop || roll_requested(); });
+            else
+                m_cv.wait(lock, [&] { return m_stop || roll_requested() || !m_buffer.empty(); });
+
+            bool          stop  = m_stop;
+            bool          roll  = roll_requested();
+            std::uint64_t rolls = m_roll_requests;
+            std::uint64_t last  = m_last_lsn;
+            m_flushing.swap(m_buffer);
+            lock.unlock();
+
+            // Records after a failure are dropped, nothing is known of the
+            // file any more.
+            bool ok = !m_failed;
+            if (ok && !m_flushing.empty()) {
+                ok = write_all(m_flushing) && ((m_options.sync == JournalSync::Os && !stop) || sync());
+                if (ok) {
+                    m_segment_written += m_flushing.size();
+                    feed(m_flushing);
+                }
+                roll = roll || m_segment_written >= m_options.segment_size;
+            }
+            m_flushing.clear();
+            if (ok && roll && m_segment_written) ok = open_segment(last + 1);
+
+            lock.lock();
+            if (!ok && !m_failed) {
+                m_failed = true;
+                logger().write(LogLevel::Error, "Journal is failed after LSN %llu, changes are refused.",
+                               (unsigned long long)m_durable_lsn);
+            }
+            if (!m_failed) m_durable_lsn = last;
+            m_rolls_done  = rolls;
+            m_roll_cv.notify_all();
+            // All waiters of failed journal are told at once.
+            auto it = std::partition(m_waiters.begin(), m_waiters.end(),
+                [this](const std::pair<std::uint64_t, Handler>& w) { return !m_failed && w.first > m_durable_lsn; });
+            std::move(it, m_waiters.end(), std::back_inserter(m_ready));
+            m_waiters.erase(it, m_waiters.end());
+            bool durable = !m_failed;
+            lock.unlock();
+
+            for (auto& w : m_ready) w.second(durable);
+            m_ready.clear();
+
+            lock.lock();
+            if (stop && m_buffer.empty()) return;
+        }
+    }
+
+    void feed(const std::vector<char>& data)
+    {
+        std::lock_guard<std::mutex> feed_lock(m_feed_mtx);
+        if (m_feeds.empty()) return;
+        auto records = std::make_shared<const std::string>(data.begin(), data.end());
+        for (auto& f : m_feeds) f.second(records);
+    }
+
+    bool write_all(const std::vector<char>& data)
+    {
+        std::size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(m_fd, data.data() + done, data.size() - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                logger().write(LogLevel::Error, "Journal: write error %d.", errno);
+                return false;
+            }
+            done += (std::size_t)n;
+        }
+        return true;
+    }
+
+    // Error of fdatasync may drop written pages, so it is never retried.
+    bool sync()
+    {
+        if (::fdatasync(m_fd) == 0) return true;
+        logger().write(LogLevel::Error, "Journal: fdatasync error %d.", errno);
+        return false;
+    }
+};
+
+#endif // TCP_TEST_JOURNAL_H
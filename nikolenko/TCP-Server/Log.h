@@ -0,0 +1,258 @@
+// Log.h
+// Leveled asynchronous log of the test server.
+//
+// A record is formatted by the calling thread right into a slot of a bounded
+// lock-free ring (many producers, one consumer) and written to std::cout by
+// a background thread, so commands never wait for the terminal or a pipe.
+// When the ring is full the record is dropped and counted. Before start()
+// and after stop() records are written at once by the calling thread.
+// Writer sleeps on a condition variable while the ring is empty, producer
+// wakes it only when it sleeps. stop() waits for producers which have taken
+// a slot and not filled it yet, so no record is lost at exit.
+//
+// Records of every request are of Debug level, which is off by default.
+// They may be sampled: sample() lets through at most the given number of
+// records per second.
+
+#ifndef TCP_TEST_LOG_H
+#define TCP_TEST_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if defined(__GNUC__)
+#   define LOG_PRINTF_FORMAT(f, a) __attribute__((format(printf, f, a)))
+#else
+#   define LOG_PRINTF_FORMAT(f, a)
+#endif
+
+enum class LogLevel : int {
+    Error   = 0,
+    Warning = 1,
+    Info    = 2,
+    Debug   = 3,    // Every request
+};
+
+inline const char* log_level_name(LogLevel level)
+{
+    switch (level) {
+    case LogLevel::Error:   return "error";
+    case LogLevel::Warning: return "warning";
+    case LogLevel::Info:    return "info";
+    case LogLevel::Debug:   return "debug";
+    }
+    return "unknown";
+}
+
+inline bool log_level_by_name(const std::string& name, LogLevel& level)
+{
+    for (int l = (int)LogLevel::Error; l <= (int)LogLevel::Debug; ++l) {
+        if (name != log_level_name((LogLevel)l)) continue;
+        level = (LogLevel)l;
+        return true;
+    }
+    return false;
+}
+
+class Logger {
+    // Number of slots is a power of two, longer records are truncated.
+    static const std::size_t m_slots       = 4096;
+    static const std::size_t m_record_size = 256;
+
+    // Slot is free for producer of position seq, or filled for consumer
+    // of position seq - 1 (bounded queue of D. Vyukov).
+    struct Slot {
+        std::atomic<std::size_t> seq;
+        LogLevel                 level;
+        char                     text[m_record_size];
+    };
+
+    std::unique_ptr<Slot[]>    m_ring;
+    std::atomic<std::size_t>   m_head{0};       // Next position of producers
+    std::size_t                m_tail = 0;      // Next position of consumer
+
+    std::atomic<int>           m_level{(int)LogLevel::Info};
+    std::atomic<std::uint64_t> m_dropped{0};
+
+    // Sampling of request records: count of records in the current second.
+    std::atomic<unsigned int>  m_rate{0};
+    std::atomic<std::int64_t>  m_rate_second{0};
+    std::atomic<unsigned int>  m_rate_count{0};
+
+    std::atomic<bool>          m_running{false};
+    std::atomic<unsigned int>  m_writing{0};    // Calls of write() in progress
+    std::atomic<bool>          m_stop{false};
+    std::thread                m_writer;
+
+    // Writer waits here for records when the ring is empty.
+    std::mutex                 m_mtx;
+    std::condition_variable    m_cv;
+    std::atomic<bool>          m_waiting{false};
+
+public:
+    Logger() : m_ring(new Slot[m_slots])
+    {
+        for (std::size_t i = 0; i < m_slots; ++i) m_ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    ~Logger() { stop(); }
+
+    void set_level(LogLevel level) { m_level = (int)level; }
+
+    // Records of requests per second, 0 - all of them.
+    void set_rate(unsigned int rate) { m_rate = rate; }
+
+    bool enabled(LogLevel level) const
+    {
+        return (int)level <= m_level.load(std::memory_order_relaxed);
+    }
+
+    // True when one more request record fits into the rate of this second.
+    bool sample()
+    {
+        unsigned int rate = m_rate.load(std::memory_order_relaxed);
+        if (!rate) return true;
+        std::int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        std::int64_t second = m_rate_second.load(std::memory_order_relaxed);
+        if (second != now && m_rate_second.compare_exchange_strong(second, now))
+            m_rate_count.store(0, std::memory_order_relaxed);
+        return m_rate_count.fetch_add(1, std::memory_order_relaxed) < rate;
+    }
+
+    LOG_PRINTF_FORMAT(3, 4)
+    void write(LogLevel level, const char* format, ...)
+    {
+        if (!enabled(level)) return;
+        va_list args;
+        va_start(args, format);
+        // Counted before m_running is read: stop() waits for the record.
+        m_writing.fetch_add(1);
+        if (m_running.load()) push(level, format, args);
+        else {
+            char text[m_record_size];
+            std::vsnprintf(text, sizeof(text), format, args);
+            print(level, text);
+            std::cout.flush();
+        }
+        m_writing.fetch_sub(1);
+        va_end(args);
+    }
+
+    // Start background writer.
+    void start()
+    {
+        if (m_running) return;
+        m_stop = false;
+        m_running = true;
+        m_writer = std::thread([this] { writer_loop(); });
+    }
+
+    // Write everything queued and stop background writer.
+    void stop()
+    {
+        if (!m_running) return;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        if (m_writer.joinable()) m_writer.join();
+        // Records from now on are written at once. Slots taken before are
+        // filled when no write() is in progress, then all of them are drained.
+        m_running = false;
+        while (m_writing.load()) std::this_thread::yield();
+        drain();
+        std::cout.flush();
+    }
+
+private:
+    void push(LogLevel level, const char* format, va_list args)
+    {
+        std::size_t pos = m_head.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &m_ring[pos & (m_slots - 1)];
+            std::size_t seq  = slot->seq.load(std::memory_order_acquire);
+            std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)pos;
+            if (diff == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if (diff < 0) {
+                // Ring is full: writer is behind, the record is lost.
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else pos = m_head.load(std::memory_order_relaxed);
+        }
+        slot->level = level;
+        std::vsnprintf(slot->text, sizeof(slot->text), format, args);
+        // Writer tells that it sleeps before it looks at the ring again,
+        // so either it sees this record or it is woken up.
+        slot->seq.store(pos + 1);
+        if (m_waiting.load()) {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_cv.notify_one();
+        }
+    }
+
+    // Record of the next position of consumer is filled. Only writer calls it.
+    bool ready() const
+    {
+        return m_ring[m_tail & (m_slots - 1)].seq.load() == m_tail + 1;
+    }
+
+    // Write records of ring, return their number. Only writer calls it.
+    std::size_t drain()
+    {
+        std::size_t n = 0;
+        for (;; ++n, ++m_tail) {
+            Slot& slot = m_ring[m_tail & (m_slots - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != m_tail + 1) break;
+            print(slot.level, slot.text);
+            slot.seq.store(m_tail + m_slots, std::memory_order_release);
+        }
+        auto dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            print(LogLevel::Warning, ("Log: " + std::to_string(dropped) + " records are dropped.").c_str());
+            ++n;
+        }
+        return n;
+    }
+
+    void writer_loop()
+    {
+        for (;;) {
+            if (drain()) std::cout.flush();
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_waiting = true;
+            m_cv.wait(lock, [this] { return m_stop || ready(); });
+            m_waiting = false;
+            if (m_stop) return;
+        }
+    }
+
+    static void print(LogLevel level, const char* text)
+    {
+        if (level <= LogLevel::Warning) std::cout << log_level_name(level) << ": ";
+        std::cout << text << '\n';
+    }
+};
+
+// The only log of process.
+inline Logger& logger()
+{
+    static Logger instance;
+    return instance;
+}
+
+#endif // TCP_TEST_LOG_H
@@ -0,0 +1,195 @@
+// Replica.h
+// Replica side of replication: connection of replica to primary server.
+//
+// Replica sends SYNC (see Protocol.h) and applies the answer to its own
+// storage: the copy of all items of primary, then its changes in order of
+// LSN. Storage is cleared before every copy, so after a lost connection the
+// replica connects again in a second and takes the whole copy again; items
+// are served meanwhile as they come. Replica writes no journal of its own:
+// primary is the only source of changes.
+//
+// Statistics of replica: connection, the last LSN applied, and lag behind
+// primary in records and in seconds since the replica had all its records.
+
+#ifndef TCP_TEST_REPLICA_H
+#define TCP_TEST_REPLICA_H
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Protocol.h"
+#include "Journal.h"
+#include "Storage.h"
+#include "Log.h"
+
+class ReplicaClient : public boost::enable_shared_from_this<ReplicaClient>
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // Pause before the next connection to primary.
+    static const int m_retry_seconds = 1;
+
+    boost::asio::ip::tcp::resolver   m_resolver;
+    boost::asio::ip::tcp::socket     m_socket;
+    boost::asio::deadline_timer      m_timer;
+    Storage&                         m_storage;
+    std::string                      m_host;
+    std::string                      m_port;
+
+    char              m_request[protocol::request_header_size];
+    char              m_header[protocol::response_header_size];
+    std::vector<char> m_payload;
+
+    bool              m_first   = true;     // Next frame is the first of SYNC
+    bool              m_synced  = false;    // Copy is complete
+    std::uint64_t     m_from    = 0;        // Changes after this LSN follow the copy
+    std::uint64_t     m_applied = 0;        // LSN of the last change applied
+    std::size_t       m_copied  = 0;        // Items of copy
+    Clock::time_point m_in_sync;            // Last time without lag
+
+public:
+    ReplicaClient(boost::asio::io_service& service, Storage& storage, const std::string& host, const std::string& port) :
+        m_resolver(service),
+        m_socket(service),
+        m_timer(service),
+        m_storage(storage),
+        m_host(host),
+        m_port(port)
+    {
+    }
+
+    void start()
+    {
+        logger().write(LogLevel::Info, "Replica of %s:%s.", m_host.c_str(), m_port.c_str());
+        connect();
+    }
+
+private:
+    void connect()
+    {
+        m_first  = true;
+        m_synced = false;
+        auto hnd = boost::bind(&ReplicaClient::on_resolve, shared_from_this(), _1, _2);
+        m_resolver.async_resolve(boost::asio::ip::tcp::resolver::query(m_host, m_port), hnd);
+    }
+
+    void on_resolve(const boost::system::error_code& err, boost::asio::ip::tcp::resolver::iterator it)
+    {
+        if (err) return retry("resolve", err);
+        auto hnd = boost::bind(&ReplicaClient::on_connect, shared_from_this(), _1);
+        boost::asio::async_connect(m_socket, it, hnd);
+    }
+
+    void on_connect(const boost::system::error_code& err)
+    {
+        if (err) return retry("connect", err);
+        boost::system::error_code ignored;
+        m_socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+
+        protocol::RequestHeader h;
+        h.opcode = protocol::OpSync;
+        protocol::encode(h, m_request);
+        auto hnd = boost::bind(&ReplicaClient::on_request, shared_from_this(), _1);
+        boost::asio::async_write(m_socket, boost::asio::buffer(m_request), hnd);
+    }
+
+    void on_request(const boost::system::error_code& err)
+    {
+        if (err) return retry("write", err);
+        m_storage.stat.replicaConnected = 1;
+        read_header();
+    }
+
+    void read_header()
+    {
+        auto hnd = boost::bind(&ReplicaClient::on_header, shared_from_this(), _1);
+        boost::asio::async_read(m_socket, boost::asio::buffer(m_header), hnd);
+    }
+
+    void on_header(const boost::system::error_code& err)
+    {
+        if (err) return retry("read", err);
+        protocol::ResponseHeader h;
+        protocol::decode(h, m_header);
+        if (h.status != protocol::StatusOk) {
+            logger().write(LogLevel::Error, "Replica: primary answers SYNC by %s.", protocol::status_name(h.status));
+            return retry("sync", boost::system::error_code());
+        }
+        m_payload.resize(h.length);
+        auto hnd = boost::bind(&ReplicaClient::on_payload, shared_from_this(), _1);
+        boost::asio::async_read(m_socket, boost::asio::buffer(m_payload), hnd);
+    }
+
+    void on_payload(const boost::system::error_code& err)
+    {
+        if (err) return retry("read", err);
+        protocol::ResponseHeader h;
+        protocol::decode(h, m_header);
+        m_storage.stat.bytesIn += protocol::response_header_size + m_payload.size();
+
+        if (m_first) {
+            m_first   = false;
+            m_from    = m_applied = h.version;
+            m_copied  = 0;
+            m_storage.clear();
+            logger().write(LogLevel::Info, "Replica: copy of primary is started, changes after LSN %llu follow.",
+                           (unsigned long long)m_from);
+        }
+        const char* p   = m_payload.data();
+        const char* end = p + m_payload.size();
+        while (p != end) {
+            JournalRecordHeader rh;
+            boost::string_view  key, val;
+            if (!parse_record(p, end, rh, key, val)) {
+                logger().write(LogLevel::Error, "Replica: damaged record from primary.");
+                return retry("sync", boost::system::error_code());
+            }
+            // Changes before the copy are in it already.
+            if (rh.lsn && rh.lsn <= m_from) continue;
+            m_storage.replicate(rh.type, key, val, rh.version, rh.expire);
+            if (rh.lsn) m_applied = rh.lsn;
+            else ++m_copied;
+        }
+        if (h.flags & protocol::ResponseSynced) {
+            m_synced  = true;
+            m_in_sync = Clock::now();
+            m_storage.stat.replicaSynced = 1;
+            logger().write(LogLevel::Info, "Replica: copy of primary is taken, %zu items.", m_copied);
+        }
+        if (m_synced) {
+            std::uint64_t lag = h.version > m_applied ? h.version - m_applied : 0;
+            if (!lag) m_in_sync = Clock::now();
+            m_storage.stat.replicaLsn    = m_applied;
+            m_storage.stat.replicaLag    = lag;
+            m_storage.stat.replicaLagMs  = (std::uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                Clock::now() - m_in_sync).count();
+        }
+        read_header();
+    }
+
+    void retry(const char* what, const boost::system::error_code& err)
+    {
+        if (err) logger().write(LogLevel::Warning, "Replica: %s error: %s", what, err.message().c_str());
+        boost::system::error_code ignored;
+        if (m_socket.is_open()) m_socket.close(ignored);
+        m_storage.stat.replicaConnected = 0;
+        m_storage.stat.replicaSynced    = 0;
+        m_timer.expires_from_now(boost::posix_time::seconds(m_retry_seconds));
+        m_timer.async_wait(boost::bind(&ReplicaClient::on_retry, shared_from_this(), _1));
+    }
+
+    void on_retry(const boost::system::error_code& err)
+    {
+        if (err) return;
+        connect();
+    }
+};
+
+#endif // TCP_TEST_REPLICA_H
@@ -0,0 +1,228 @@
+// Snapshot.h
+// Point-in-time image of storage in a compact binary file.
+//
+//     SnapshotHeader  - magic, LSN of journal when the snapshot was started,
+//                       the last version given by storage then;
+//     items           - SnapshotItemHeader (key and value length, version,
+//                       expiry time), key, value;
+//     end of items    - SnapshotItemHeader with zero key length;
+//     SnapshotTrailer - number of items and CRC-32 of everything above.
+//
+// Snapshot is written to "<path>.tmp" and renamed when complete, so the file
+// "<path>" is always either the previous or the new complete snapshot.
+// Storage is not frozen while the snapshot is written: changes made meanwhile
+// have LSN above the one of header and are replayed from journal on top.
+// Reader checks the whole file before it applies the first item.
+
+#ifndef TCP_TEST_SNAPSHOT_H
+#define TCP_TEST_SNAPSHOT_H
+
+#include <boost/crc.hpp>
+#include <boost/fusion/include/adapt_struct.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "Protocol.h"
+#include "Journal.h"
+#include "Log.h"
+
+struct SnapshotHeader {
+    std::uint32_t magic   = 0x4B565333;   // "KVS3", items with versions and TTL
+    std::uint64_t lsn     = 0;
+    std::uint64_t version = 0;
+};
+
+struct SnapshotItemHeader {
+    std::uint16_t key_length   = 0;
+    std::uint32_t value_length = 0;
+    std::uint64_t version      = 0;
+    std::uint32_t expire       = 0;
+};
+
+struct SnapshotTrailer {
+    std::uint64_t count = 0;
+    std::uint32_t crc   = 0;
+};
+
+BOOST_FUSION_ADAPT_STRUCT(SnapshotHeader,     magic, lsn, version)
+BOOST_FUSION_ADAPT_STRUCT(SnapshotItemHeader, key_length, value_length, version, expire)
+BOOST_FUSION_ADAPT_STRUCT(SnapshotTrailer,    count, crc)
+
+const std::size_t snapshot_header_size  = 4 + 8 + 8;
+const std::size_t snapshot_item_size    = 2 + 4 + 8 + 4;
+const std::size_t snapshot_trailer_size = 8 + 4;
+
+//-----------------------------------------------------------------------------
+// Writer
+//-----------------------------------------------------------------------------
+
+class SnapshotWriter {
+    std::string        m_path;
+    std::FILE*         m_file  = nullptr;
+    std::uint64_t      m_count = 0;
+    boost::crc_32_type m_crc;
+    std::vector<char>  m_buf;
+
+public:
+    explicit SnapshotWriter(const std::string& path) : m_path(path) {}
+
+    ~SnapshotWriter()
+    {
+        if (!m_file) return;
+        std::fclose(m_file);
+        std::remove((m_path + ".tmp").c_str());
+    }
+
+    bool open(std::uint64_t lsn, std::uint64_t version)
+    {
+        m_file = std::fopen((m_path + ".tmp").c_str(), "wb");
+        if (!m_file) return false;
+        SnapshotHeader h;
+        h.lsn     = lsn;
+        h.version = version;
+        char buf[snapshot_header_size];
+        protocol::encode(h, buf);
+        return write(buf, sizeof(buf));
+    }
+
+    // Items are collected in memory, flush() writes them to file.
+    void add(const char* key, std::size_t key_length, const char* val, std::size_t val_length, 
+             std::uint64_t version, std::uint32_t expire)
+    {
+        SnapshotItemHeader h;
+        h.key_length   = (std::uint16_t)key_length;
+        h.value_length = (std::uint32_t)val_length;
+        h.version      = version;
+        h.expire       = expire;
+        std::size_t pos = m_buf.size();
+        m_buf.resize(pos + snapshot_item_size + key_length + val_length);
+        char* p = protocol::encode(h, &m_buf[pos]);
+        p = std::copy(key, key + key_length, p);
+        std::copy(val, val + val_length, p);
+        ++m_count;
+    }
+
+    bool flush()
+    {
+        bool ok = write(m_buf.data(), m_buf.size());
+        m_buf.clear();
+        return ok;
+    }
+
+    // Write trailer, sync and rename the file to its final name.
+    bool commit()
+    {
+        char end[snapshot_item_size];
+        protocol::encode(SnapshotItemHeader(), end);
+        if (!flush() || !write(end, sizeof(end))) return false;
+
+        SnapshotTrailer t;
+        t.count = m_count;
+        t.crc   = m_crc.checksum();
+        char buf[snapshot_trailer_size];
+        protocol::encode(t, buf);
+        if (std::fwrite(buf, 1, sizeof(buf), m_file) != sizeof(buf)) return false;
+        if (std::fflush(m_file) || ::fdatasync(fileno(m_file))) return false;
+        std::fclose(m_file);
+        m_file = nullptr;
+        if (std::rename((m_path + ".tmp").c_str(), m_path.c_str())) return false;
+        sync_directory_of(m_path);
+        return true;
+    }
+
+    std::uint64_t count() const { return m_count; }
+
+private:
+    bool write(const char* data, std::size_t size)
+    {
+        m_crc.process_bytes(data, size);
+        return std::fwrite(data, 1, size, m_file) == size;
+    }
+};
+
+//-----------------------------------------------------------------------------
+// Reader
+//-----------------------------------------------------------------------------
+
+enum class SnapshotRead {
+    None,       // No snapshot file
+    Loaded,
+    Damaged,    // Nothing is applied
+};
+
+// Read snapshot f from its beginning to h, check items and trailer.
+// Items are given to apply only when apply_items is set.
+// Return false when the file is damaged.
+template<typename F>
+bool read_snapshot_file(std::FILE* f, SnapshotHeader& h, bool apply_items, F& apply)
+{
+    std::rewind(f);
+    boost::crc_32_type crc;
+    std::vector<char>  buf;
+    auto read = [&](std::size_t size) -> bool {
+        buf.resize(size);
+        if (std::fread(buf.data(), 1, size, f) != size) return false;
+        crc.process_bytes(buf.data(), size);
+        return true;
+    };
+
+    if (!read(snapshot_header_size)) return false;
+    protocol::decode(h, buf.data());
+    if (h.magic != SnapshotHeader().magic) return false;
+
+    std::uint64_t count = 0;
+    for (;;) {
+        SnapshotItemHeader ih;
+        if (!read(snapshot_item_size)) return false;
+        protocol::decode(ih, buf.data());
+        if (!ih.key_length) break;
+
+        if (ih.key_length > protocol::max_key_length || ih.value_length > protocol::max_value_length ||
+            !read(ih.key_length + ih.value_length)) return false;
+        if (apply_items) {
+            apply(std::string(buf.data(), ih.key_length),
+                  std::string(buf.data() + ih.key_length, ih.value_length),
+                  ih.version, ih.expire);
+        }
+        ++count;
+    }
+
+    SnapshotTrailer t;
+    auto expected = crc.checksum();
+    if (!read(snapshot_trailer_size)) return false;
+    protocol::decode(t, buf.data());
+    return t.count == count && t.crc == expected;
+}
+
+// Call apply(key, value, version, expire) for every item of snapshot, set lsn of it
+// and the last version given before it (0 when it is not loaded).
+// The whole file is checked before the first item is applied, so damaged
+// snapshot applies nothing.
+template<typename F>
+SnapshotRead read_snapshot(const std::string& path, std::uint64_t& lsn, std::uint64_t& version, F apply)
+{
+    lsn     = 0;
+    version = 0;
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) return SnapshotRead::None;
+
+    SnapshotHeader h;
+    bool ok = read_snapshot_file(f, h, false, apply) && read_snapshot_file(f, h, true, apply);
+    std::fclose(f);
+
+    if (!ok) {
+        logger().write(LogLevel::Error, "Snapshot \"%s\" is damaged.", path.c_str());
+        return SnapshotRead::Damaged;
+    }
+    lsn     = h.lsn;
+    version = h.version;
+    return SnapshotRead::Loaded;
+}
+
+#endif // TCP_TEST_SNAPSHOT_H
@@ -0,0 +1,158 @@
+// Statistics.h
+// Counters and latency histograms of the test server.
+//
+// Every counter is an atomic updated with relaxed order: commands of all
+// threads count themselves without any lock, and the statistics may be read
+// at any moment without stopping them. Values read together are not an
+// exact snapshot, which is fine for monitoring.
+//
+// metrics_text() renders everything in the Prometheus text format, it is
+// the answer to the STATS command and to the HTTP metrics endpoint.
+
+#ifndef TCP_TEST_STATISTICS_H
+#define TCP_TEST_STATISTICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "Protocol.h"
+#include "Histogram.h"
+
+//-----------------------------------------------------------------------------
+// Statistics of server
+//-----------------------------------------------------------------------------
+
+struct ServerStastistics {
+    std::atomic<unsigned int> successInsert{0};
+    std::atomic<unsigned int> failInsert   {0};
+    std::atomic<unsigned int> successUpdate{0};
+    std::atomic<unsigned int> failUpdate   {0};
+    std::atomic<unsigned int> successDelete{0};
+    std::atomic<unsigned int> failDelete   {0};
+    std::atomic<unsigned int> successGet   {0};
+    std::atomic<unsigned int> failGet      {0};
+    std::atomic<unsigned int> successCas   {0};
+    std::atomic<unsigned int> failCas      {0};
+    std::atomic<unsigned int> successCDelete{0};
+    std::atomic<unsigned int> failCDelete  {0};
+    std::atomic<unsigned int> successExpire{0};
+    std::atomic<unsigned int> failExpire   {0};
+
+    // Items in storage.
+    std::atomic<std::int64_t>  entries    {0};
+    // Items deleted because their TTL is over.
+    std::atomic<std::uint64_t> expired    {0};
+    // Items evicted by the memory limit.
+    std::atomic<std::uint64_t> evicted    {0};
+    // Values compressed by changes, GET answers sent compressed.
+    std::atomic<std::uint64_t> compressed    {0};
+    std::atomic<std::uint64_t> compressedSent{0};
+    // Connections open now and accepted since start.
+    std::atomic<unsigned int>  connections{0};
+    std::atomic<std::uint64_t> accepted   {0};
+    // Connections refused by the limit with StatusBusy, closed by timeouts.
+    std::atomic<std::uint64_t> refused    {0};
+    std::atomic<std::uint64_t> timedOut   {0};
+    // Replicas fed by primary now.
+    std::atomic<unsigned int>  replicas   {0};
+    // Replica: connected to primary, has the copy of it, the last LSN of
+    // primary applied, lag behind it in records and in milliseconds.
+    std::atomic<unsigned int>  replicaConnected{0};
+    std::atomic<unsigned int>  replicaSynced   {0};
+    std::atomic<std::uint64_t> replicaLsn      {0};
+    std::atomic<std::uint64_t> replicaLag      {0};
+    std::atomic<std::uint64_t> replicaLagMs    {0};
+    // Bytes of requests and answers.
+    std::atomic<std::uint64_t> bytesIn    {0};
+    std::atomic<std::uint64_t> bytesOut   {0};
+    // Time of execution of commands by opcode.
+    LatencyHistogram           latency[protocol::OpLast + 1];
+};
+
+// Text of all statistics in the Prometheus exposition format.
+inline std::string metrics_text(const ServerStastistics& stat)
+{
+    std::string out;
+    char line[256];
+    auto add = [&](const char* format, auto... args) {
+        std::snprintf(line, sizeof(line), format, args...);
+        out += line;
+    };
+    auto header = [&](const char* name, const char* type, const char* help) {
+        out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    };
+    auto lower = [](const char* name) {
+        std::string s(name);
+        for (auto& c : s) c = (char)::tolower(c);
+        return s;
+    };
+
+    struct { std::uint8_t op; const std::atomic<unsigned int>& success; const std::atomic<unsigned int>& fail; } commands[] = {
+        { protocol::OpInsert, stat.successInsert, stat.failInsert },
+        { protocol::OpUpdate, stat.successUpdate, stat.failUpdate },
+        { protocol::OpDelete, stat.successDelete, stat.failDelete },
+        { protocol::OpGet,    stat.successGet,    stat.failGet    },
+        { protocol::OpCas,    stat.successCas,    stat.failCas    },
+        { protocol::OpCDelete, stat.successCDelete, stat.failCDelete },
+        { protocol::OpExpire, stat.successExpire, stat.failExpire },
+    };
+
+    header("kv_commands_total", "counter", "Commands executed by storage.");
+    for (auto& c : commands) {
+        auto name = lower(protocol::opcode_name(c.op));
+        add("kv_commands_total{command=\"%s\",result=\"success\"} %u\n", name.c_str(), c.success.load());
+        add("kv_commands_total{command=\"%s\",result=\"fail\"} %u\n",    name.c_str(), c.fail.load());
+    }
+
+    header("kv_command_duration_seconds", "summary", "Time of execution of command.");
+    for (std::uint8_t op = protocol::OpInsert; op <= protocol::OpLast; ++op) {
+        auto  name = lower(protocol::opcode_name(op));
+        auto& h    = stat.latency[op];
+        for (double q : { 0.5, 0.99, 0.999 })
+            add("kv_command_duration_seconds{command=\"%s\",quantile=\"%g\"} %.9f\n",
+                name.c_str(), q, h.percentile(q) / 1e9);
+        add("kv_command_duration_seconds_sum{command=\"%s\"} %.9f\n", name.c_str(), h.sum_ns() / 1e9);
+        add("kv_command_duration_seconds_count{command=\"%s\"} %llu\n", name.c_str(), (unsigned long long)h.count());
+    }
+
+    header("kv_entries", "gauge", "Items in storage.");
+    add("kv_entries %lld\n", (long long)stat.entries.load());
+    header("kv_expired_total", "counter", "Items deleted because their TTL is over.");
+    add("kv_expired_total %llu\n", (unsigned long long)stat.expired.load());
+    header("kv_evicted_total", "counter", "Items evicted by the memory limit.");
+    add("kv_evicted_total %llu\n", (unsigned long long)stat.evicted.load());
+    header("kv_compressed_values_total", "counter", "Values compressed by changes.");
+    add("kv_compressed_values_total %llu\n", (unsigned long long)stat.compressed.load());
+    header("kv_compressed_sent_total", "counter", "Values of GET sent compressed.");
+    add("kv_compressed_sent_total %llu\n", (unsigned long long)stat.compressedSent.load());
+    header("kv_connections", "gauge", "Client connections open now.");
+    add("kv_connections %u\n", stat.connections.load());
+    header("kv_connections_accepted_total", "counter", "Client connections accepted.");
+    add("kv_connections_accepted_total %llu\n", (unsigned long long)stat.accepted.load());
+    header("kv_connections_refused_total", "counter", "Client connections refused as busy.");
+    add("kv_connections_refused_total %llu\n", (unsigned long long)stat.refused.load());
+    header("kv_connections_timed_out_total", "counter", "Client connections closed by timeouts.");
+    add("kv_connections_timed_out_total %llu\n", (unsigned long long)stat.timedOut.load());
+    header("kv_replicas", "gauge", "Replicas fed by this server.");
+    add("kv_replicas %u\n", stat.replicas.load());
+    header("kv_replication_connected", "gauge", "Replica is connected to primary.");
+    add("kv_replication_connected %u\n", stat.replicaConnected.load());
+    header("kv_replication_synced", "gauge", "Replica has the copy of primary.");
+    add("kv_replication_synced %u\n", stat.replicaSynced.load());
+    header("kv_replication_lsn", "gauge", "The last LSN of primary applied by replica.");
+    add("kv_replication_lsn %llu\n", (unsigned long long)stat.replicaLsn.load());
+    header("kv_replication_lag_records", "gauge", "Records of primary not applied by replica yet.");
+    add("kv_replication_lag_records %llu\n", (unsigned long long)stat.replicaLag.load());
+    header("kv_replication_lag_seconds", "gauge", "Time since replica had all records of primary.");
+    add("kv_replication_lag_seconds %.3f\n", stat.replicaLagMs.load() / 1000.0);
+    header("kv_received_bytes_total", "counter", "Bytes received from clients.");
+    add("kv_received_bytes_total %llu\n", (unsigned long long)stat.bytesIn.load());
+    header("kv_sent_bytes_total", "counter", "Bytes sent to clients.");
+    add("kv_sent_bytes_total %llu\n", (unsigned long long)stat.bytesOut.load());
+    return out;
+}
+
+#endif // TCP_TEST_STATISTICS_H
@@ -0,0 +1,1617 @@
+// Storage.h
+// Key-value storage of the test server.
+//
+// Keys are distributed by hash between independent shards. Every shard is
+// a multi_index container with its own reader/writer lock: GET of any keys
+// run in parallel, writers contend only when their keys share a shard.
+//
+// All shards live in one memory-mapped file (boost::interprocess), keys and
+// values are allocated in the same segment. Restart of server reopens the
+// file and serves the data at once, without any reload step. The segment
+// grows automatically when it is full.
+//
+// Memory of small entries is kept low: short key and value are stored in
+// place in the node of index, longer ones in a block of the slab of shard,
+// which gives the nodes as well (see ShardSlab).
+//
+// Every change gives its key a new version from the counter of storage, it
+// is kept in the item and in the journal record of change. CAS and CDELETE
+// compare it with the expected one under the lock of shard, so the check
+// and the change are one atomic step.
+//
+// Item may have expiry time. Expired item is absent for all commands: GET
+// skips it, a change deletes it first. Besides, every shard has a timer
+// wheel of keys with TTL (see TimerWheel.h), expire_step() deletes the due
+// ones by small steps. The wheels are in memory of process: after start
+// they are filled by a sweep of shards, made by the same steps.
+//
+// Storage may have a memory limit, then it works as a cache: every shard
+// takes its part of the limit for bytes of its slab, and a change which
+// goes above it first evicts cold items of the shard by CLOCK. Every access
+// sets the reference bit of item, the hand of shard goes round the index,
+// clears the set bits and evicts the first item without one.
+//
+// Values of at least the given size are kept compressed by LZ4 (see
+// Lz4.h) when it makes them shorter, the item has ItemCompressed flag then.
+// They are compressed before the lock of shard is taken, GET which accepts
+// compressed value gets it as it is kept, other readers unpack it. Journal,
+// snapshots and replicas get plain values.
+//
+// Replica gets a copy of primary storage by copy_chunk() in the form of
+// journal records, then the records of journal of primary, and applies
+// them all by replicate().
+//
+// Changes are written to the journal (see Journal.h) as well. When server
+// was stopped abnormally, the file is rebuilt from the latest snapshot (see
+// Snapshot.h) and the tail of journal after it. Snapshots are made by
+// background thread, journal segments covered by snapshot are removed.
+//
+// Layout of shard is chosen at compile time:
+//   STORAGE_HASHED_KEYS - hashed index on keys instead of ordered one;
+//   STORAGE_VALUE_INDEX - additional ordered index on values. No command
+//                         looks up by value, so it is not built by default;
+//   STORAGE_SWISS_INDEX - open addressing hash index (see SwissIndex.h) for
+//                         lookups by key, the ordered index stays for SCAN.
+
+#ifndef TCP_TEST_STORAGE_H
+#define TCP_TEST_STORAGE_H
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/key_extractors.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/member.hpp>
+
+#include <boost/interprocess/managed_mapped_file.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/string.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/integer/integer_log2.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Protocol.h"
+#include "Log.h"
+#include "Journal.h"
+#include "Snapshot.h"
+#include "Statistics.h"
+#include "SwissIndex.h"
+#include "TimerWheel.h"
+
+#if defined(STORAGE_SWISS_INDEX) && defined(STORAGE_HASHED_KEYS)
+#   error "STORAGE_SWISS_INDEX goes with the ordered index on keys."
+#endif
+
+using namespace ::boost::multi_index;
+using namespace ::boost::interprocess;
+
+//-----------------------------------------------------------------------------
+// Storage for BD
+//-----------------------------------------------------------------------------
+
+typedef managed_mapped_file::segment_manager                               SegmentManager;
+
+// Keys of items are compared with std::string without conversion.
+struct StringLess {
+    template<typename A, typename B>
+    bool operator()(const A& a, const B& b) const {
+        return boost::string_view(a.data(), a.size()) < boost::string_view(b.data(), b.size());
+    }
+};
+
+struct StringEqual {
+    template<typename A, typename B>
+    bool operator()(const A& a, const B& b) const {
+        return boost::string_view(a.data(), a.size()) == boost::string_view(b.data(), b.size());
+    }
+};
+
+struct StringHash {
+    template<typename A>
+    std::size_t operator()(const A& a) const {
+        return boost::hash_range(a.data(), a.data() + a.size());
+    }
+};
+
+// Memory of nodes of index of shard and of keys and values which do not fit
+// into their items. Blocks of one size class are cut from slabs of the
+// segment, freed blocks are kept in the list of their class for the next
+// allocations of it: no header per block and no fragmentation of segment by
+// millions of small allocations. Slabs are never returned to the segment.
+// Blocks above the largest class are allocated by the segment. Slab is used
+// under exclusive lock of its shard.
+class ShardSlab {
+public:
+    static const std::size_t slab_size = 64 * 1024;
+    static const std::size_t max_block = 4096;
+
+private:
+    // Classes by 8 bytes up to 128, then 4 classes per power of two.
+    static const std::size_t m_classes = 16 + 5 * 4;
+
+    struct FreeBlock {
+        offset_ptr<FreeBlock> next;
+    };
+
+    offset_ptr<FreeBlock> m_free[m_classes];
+    offset_ptr<char>      m_slab;               // Rest of the current slab
+    std::size_t           m_slab_left = 0;
+    std::size_t           m_used      = 0;      // Bytes of blocks given out
+
+public:
+    // Bytes of blocks in use, by size of their classes.
+    std::size_t used() const { return m_used; }
+
+    char* allocate(SegmentManager* segment, std::size_t size)
+    {
+        if (size > max_block) {
+            char* p = static_cast<char*>(segment->allocate(size));
+            m_used += size;
+            return p;
+        }
+        std::size_t c = class_of(size);
+        if (m_free[c]) {
+            FreeBlock* b = m_free[c].get();
+            m_free[c] = b->next;
+            m_used += class_size(c);
+            return reinterpret_cast<char*>(b);
+        }
+        std::size_t bytes = class_size(c);
+        if (m_slab_left < bytes) {
+            // Rest of the old slab is lost, it is less than one block.
+            m_slab      = static_cast<char*>(segment->allocate(slab_size));
+            m_slab_left = slab_size;
+        }
+        char* p = m_slab.get();
+        m_slab      += bytes;
+        m_slab_left -= bytes;
+        m_used      += bytes;
+        return p;
+    }
+
+    void deallocate(SegmentManager* segment, char* p, std::size_t size)
+    {
+        if (size > max_block) {
+            segment->deallocate(p);
+            m_used -= size;
+            return;
+        }
+        std::size_t c = class_of(size);
+        m_used -= class_size(c);
+        FreeBlock* b = ::new (p) FreeBlock;
+        b->next   = m_free[c];
+        m_free[c] = b;
+    }
+
+    static std::size_t class_of(std::size_t size)
+    {
+        if (size <= 128) return (size + 7) / 8 - 1;
+        std::size_t k = boost::integer_log2(size - 1);     // 2^k < size <= 2^(k+1)
+        return 16 + (k - 7) * 4 + (size - 1 - (std::size_t(1) << k)) / (std::size_t(1) << (k - 2));
+    }
+
+    static std::size_t class_size(std::size_t c)
+    {
+        if (c < 16) return (c + 1) * 8;
+        std::size_t k = 7 + (c - 16) / 4;
+        return (std::size_t(1) << k) + ((c - 16) % 4 + 1) * (std::size_t(1) << (k - 2));
+    }
+};
+
+// Allocator of container of shard on its slab.
+template<typename T>
+class SlabAllocator {
+public:
+    typedef T                   value_type;
+    typedef offset_ptr<T>       pointer;
+    typedef offset_ptr<const T> const_pointer;
+    typedef T&                  reference;
+    typedef const T&            const_reference;
+    typedef std::size_t         size_type;
+    typedef std::ptrdiff_t      difference_type;
+
+    template<typename U> struct rebind { typedef SlabAllocator<U> other; };
+
+    SlabAllocator(ShardSlab* slab, SegmentManager* segment) : m_slab(slab), m_segment(segment) {}
+
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U>& other) : m_slab(other.m_slab), m_segment(other.m_segment) {}
+
+    pointer allocate(size_type n)
+    {
+        return pointer(reinterpret_cast<T*>(m_slab->allocate(m_segment.get(), n * sizeof(T))));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        m_slab->deallocate(m_segment.get(), reinterpret_cast<char*>(p.get()), n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const SlabAllocator<U>& other) const { return m_slab == other.m_slab; }
+    template<typename U>
+    bool operator!=(const SlabAllocator<U>& other) const { return m_slab != other.m_slab; }
+
+    offset_ptr<ShardSlab>      m_slab;
+    offset_ptr<SegmentManager> m_segment;
+};
+
+// Item of shard. Key and value go one after another: in place when they are
+// short together, otherwise in a block of the slab of shard, which is
+// allocated and freed by Storage.
+struct StorageItem {
+    // Size of item is 56 bytes.
+    static const std::size_t in_place_size = 28;
+
+    enum ItemFlags : std::uint8_t {
+        ItemCompressed = 1,             // Value is protocol::compress_value()
+    };
+
+    offset_ptr<char> m_block;           // Key and value, null when in place
+    std::uint64_t    m_version  = 0;    // Given by the last change of item
+    std::uint32_t    m_val_size = 0;
+    std::uint32_t    m_expire   = 0;    // Seconds since epoch, 0 - never
+    std::uint16_t    m_key_size = 0;
+    // Reference bit of CLOCK, GET sets it under shared lock of shard. New
+    // item has it clear: otherwise the first round of hand clears all bits,
+    // hot ones too, and the next one evicts items just by order of keys.
+    mutable std::atomic<std::uint8_t> m_referenced{0};
+    std::uint8_t     m_flags    = 0;
+    char             m_in_place[in_place_size];
+
+    struct IndByK {};
+#if defined(STORAGE_VALUE_INDEX)
+    struct IndByV {};
+#endif
+
+    StorageItem(boost::string_view key, boost::string_view val, char* block, 
+                std::uint64_t version, std::uint32_t expire, std::uint8_t flags) :
+        m_version(version),
+        m_expire(expire),
+        m_flags(flags)
+    {
+        set(key, val, block);
+    }
+
+    static bool in_place(std::size_t size) { return size <= in_place_size; }
+
+    const char*        data()  const { return m_block ? m_block.get() : m_in_place; }
+    std::size_t        size()  const { return m_key_size + m_val_size; }
+    boost::string_view key()   const { return boost::string_view(data(), m_key_size); }
+    boost::string_view value() const { return boost::string_view(data() + m_key_size, m_val_size); }
+
+    bool expired(std::uint32_t now) const { return m_expire && m_expire <= now; }
+    bool compressed() const { return (m_flags & ItemCompressed) != 0; }
+
+    // Access of item for CLOCK. The bit is written only when it is clear,
+    // so readers of a hot item do not share its cache line for writing.
+    void touch() const
+    {
+        if (!m_referenced.load(std::memory_order_relaxed)) m_referenced.store(1, std::memory_order_relaxed);
+    }
+
+    // Block is null for key and value in place. Key may be the current one.
+    void set(boost::string_view key, boost::string_view val, char* block)
+    {
+        char* p = block ? block : m_in_place;
+        std::memmove(p, key.data(), key.size());
+        std::memcpy(p + key.size(), val.data(), val.size());
+        m_block    = block;
+        m_key_size = (std::uint16_t)key.size();
+        m_val_size = (std::uint32_t)val.size();
+    }
+
+    // New block is allocated before modify, so the modifier never throws.
+    struct ValChange {
+        boost::string_view val;
+        char*              block;
+        std::uint64_t      version;
+        std::uint32_t      expire;
+        std::uint8_t       flags;
+        ValChange(boost::string_view _val, char* _block, std::uint64_t _version, std::uint32_t _expire, 
+                  std::uint8_t _flags) : 
+            val(_val), block(_block), version(_version), expire(_expire), flags(_flags) {}
+        void operator()(StorageItem& r) 
+        { 
+            r.set(r.key(), val, block);
+            r.m_version = version;
+            r.m_expire  = expire;
+            r.m_flags   = flags;
+            r.touch();
+        }
+    };
+
+    struct ExpireChange {
+        std::uint32_t expire;
+        explicit ExpireChange(std::uint32_t _expire) : expire(_expire) {}
+        void operator()(StorageItem& r) { r.m_expire = expire; }
+    };
+};
+
+static_assert(sizeof(StorageItem) == 56, "StorageItem layout");
+
+typedef boost::multi_index_container<
+    StorageItem,
+    indexed_by<
+#if defined(STORAGE_HASHED_KEYS)
+        hashed_unique<
+            tag<StorageItem::IndByK>,
+            const_mem_fun<StorageItem,
+            boost::string_view,
+            &StorageItem::key>,
+            StringHash,
+            StringEqual
+        >
+#else
+        ordered_unique<
+            tag<StorageItem::IndByK>,
+            const_mem_fun<StorageItem,
+            boost::string_view,
+            &StorageItem::key>,
+            StringLess
+        >
+#endif
+#if defined(STORAGE_VALUE_INDEX)
+        ,
+        ordered_non_unique<
+            tag<StorageItem::IndByV>,
+            const_mem_fun<StorageItem,
+            boost::string_view,
+            &StorageItem::value>,
+            StringLess
+        >
+#endif
+    >,
+    SlabAllocator<StorageItem>
+> StorageContainer;
+
+typedef StorageContainer::index<StorageItem::IndByK>::type  StorageIndK;
+typedef StorageIndK::const_iterator  StorageIteratorK;
+
+// Files of different layouts are not compatible. Version of file format
+// is kept in the high byte, the options of build in the low one.
+//   1 - shard of key is chosen by std::hash<std::string>;
+//   2 - shard of key is chosen by StringHash;
+//   3 - key and value in place or in slab of shard, nodes in slab;
+//   4 - version of item;
+//   5 - expiry time of item;
+//   6 - reference bit of item, bytes used by slab;
+//   7 - flags of item, compressed values.
+const std::uint32_t storage_version = 7;
+const std::uint32_t storage_layout  = storage_version << 8 | 1
+#if defined(STORAGE_HASHED_KEYS)
+    | 2
+#endif
+#if defined(STORAGE_VALUE_INDEX)
+    | 4
+#endif
+#if defined(STORAGE_SWISS_INDEX)
+    | 8
+#endif
+    ;
+
+// Position of walk over shard by chunks, it stays valid while shard is
+// unlocked between chunks. Items changed meanwhile may be visited or not,
+// all other items are visited at least once.
+struct ShardCursor {
+#if defined(STORAGE_HASHED_KEYS)
+    std::size_t bucket       = 0;
+    std::size_t bucket_count = 0;
+#else
+    std::string last_key;
+#endif
+    bool        started      = false;
+    bool        done         = false;
+};
+
+// Call f(item) for about limit next items of shard. Caller locks the shard.
+template<typename F>
+void walk_shard(const StorageContainer& container, ShardCursor& cursor, std::size_t limit, F f)
+{
+    const StorageIndK& ik = container.get<StorageItem::IndByK>();
+#if defined(STORAGE_HASHED_KEYS)
+    // Rehash moves items between buckets: walk the shard again.
+    if (!cursor.started || cursor.bucket_count != ik.bucket_count()) {
+        cursor.bucket       = 0;
+        cursor.bucket_count = ik.bucket_count();
+    }
+    cursor.started = true;
+    std::size_t n = 0;
+    for (; cursor.bucket < cursor.bucket_count && n < limit; ++cursor.bucket) {
+        for (auto it = ik.begin(cursor.bucket); it != ik.end(cursor.bucket); ++it, ++n) f(*it);
+    }
+    cursor.done = cursor.bucket == cursor.bucket_count;
+#else
+    StorageIteratorK it = cursor.started ? ik.upper_bound(cursor.last_key) : ik.begin();
+    cursor.started = true;
+    for (std::size_t n = 0; it != ik.end() && n < limit; ++it, ++n) {
+        f(*it);
+        boost::string_view key = it->key();
+        cursor.last_key.assign(key.data(), key.size());
+    }
+    cursor.done = it == ik.end();
+#endif
+}
+
+// State of copy of storage for replica between its chunks. Copy is not a
+// snapshot, as a snapshot file is not: changes made meanwhile are sent to
+// replica after it.
+struct StorageCopy {
+    std::size_t shard = 0;
+    ShardCursor cursor;
+    bool        done  = false;
+};
+
+// State of SCAN or PREFIX between chunks of its answer. Keys of shards are
+// merged in order: every shard has a buffer of its next items, it is locked
+// only to refill the buffer. Scan is not a snapshot: keys changed while it
+// goes may be seen with the old value, new value or not at all.
+struct StorageScan {
+    std::string   prefix;               // Only keys with this prefix
+    std::string   from;                 // First key, or the cursor
+    bool          after     = false;    // Scan keys after from
+    std::uint64_t left      = 0;        // Items to return before the limit
+    bool          done      = false;
+    bool          truncated = false;    // Stopped by limit
+
+    struct ShardBuffer {
+        std::deque<std::pair<std::string, std::string>> items;
+        std::string last;               // Last key copied to items
+        bool        started   = false;
+        bool        exhausted = false;
+    };
+    std::vector<ShardBuffer> shards;
+
+    // Start new scan, limit 0 - no limit.
+    void reset(boost::string_view start, boost::string_view prefix_, boost::string_view cursor, std::uint32_t limit)
+    {
+        prefix.assign(prefix_.data(), prefix_.size());
+        after = !cursor.empty();
+        if (after) from.assign(cursor.data(), cursor.size());
+        else       from.assign(start.data(), start.size());
+        left      = limit ? limit : UINT64_MAX;
+        done      = false;
+        truncated = false;
+        shards.clear();
+    }
+};
+
+// Header of storage file.
+struct StorageHeader {
+    std::uint32_t layout    = storage_layout;
+    std::uint32_t shards    = 0;
+    // Set by clean shutdown, reset while server works with the file.
+    bool          clean     = false;
+    // Journal holds every change since the file was created.
+    bool          journaled = false;
+    // Last journal record contained in the file, valid when clean.
+    std::uint64_t lsn       = 0;
+    // Last version given to a change, commands of all shards take the next.
+    std::atomic<std::uint64_t> version{0};
+    // Some item got TTL: timer wheels are filled by sweep after start.
+    std::atomic<bool>          ttl_used{false};
+};
+
+typedef SwissIndex<StorageItem, SegmentManager> SwissKeyIndex;
+
+// One partition of storage, guarded by its own reader/writer lock.
+struct StorageShard {
+    std::shared_timed_mutex mtx;
+    StorageContainer*       container = nullptr;
+    ShardSlab*              slab      = nullptr;
+#if defined(STORAGE_SWISS_INDEX)
+    SwissKeyIndex*          swiss     = nullptr;
+#endif
+    // Keys with TTL by expiry time, in memory of process, and the sweep
+    // which fills it after start. Guarded by the exclusive lock of shard.
+    TimerWheel<std::string> wheel;
+    ShardCursor             sweep;
+    bool                    swept     = true;
+    // Hand of CLOCK, in memory of process as well.
+    ShardCursor             hand;
+};
+
+class Storage {
+    // Initial size of storage file, it is sparse until filled.
+    static const std::size_t m_initial_size = 64 * 1024 * 1024;
+
+    std::string            m_file_path = "";
+    unsigned int           m_shards_count;
+    std::size_t            m_memory_limit;          // Bytes, 0 - no limit
+    std::size_t            m_compress_min;          // Bytes, 0 - values are plain
+
+    // Every command holds this lock shared, growth of file holds it exclusive:
+    // remapping moves the segment, so nobody may hold pointers into it.
+    std::shared_timed_mutex   m_segment_mtx;
+    managed_mapped_file*      m_segment = nullptr;
+    StorageHeader*            m_header  = nullptr;
+    std::vector<StorageShard> m_shards;
+
+    JournalOptions             m_journal_options;
+    boost::scoped_ptr<Journal> m_journal;
+
+    // Items copied from shard under one short lock while snapshot is made.
+    static const std::size_t m_snapshot_chunk = 1024;
+    // Items deleted or swept by expire_step() under one lock of shard.
+    static const std::size_t m_expire_budget = 1024;
+    // Bytes taken by item besides its key and value: node of index.
+    static const std::size_t m_item_overhead = 96;
+    // Items and bytes copied from shard under one short lock by scan.
+    static const std::size_t m_scan_buffer_items = 64;
+    static const std::size_t m_scan_buffer_bytes = 256 * 1024;
+
+    std::mutex              m_snapshot_mtx;        // One snapshot at a time
+    std::mutex              m_snapshot_thread_mtx;
+    std::condition_variable m_snapshot_cv;
+    std::thread             m_snapshot_thread;
+    bool                    m_snapshot_stop = false;
+    std::uint64_t           m_snapshot_appended = 0;
+
+public:
+    ServerStastistics stat;
+
+public:
+    // Memory limit is in bytes, 0 - no limit. Values of compress_min bytes
+    // and longer are compressed, 0 - never.
+    explicit Storage (
+        unsigned int          shards       = 16, 
+        const JournalOptions& journal      = JournalOptions(),
+        std::size_t           memory_limit = 0,
+        std::size_t           compress_min = 0) : 
+        m_shards_count(shards ? shards : 1),
+        m_memory_limit(memory_limit),
+#if defined(STORAGE_VALUE_INDEX)
+        // Index on values orders them as they are kept, so they stay plain.
+        m_compress_min(0),
+#else
+        m_compress_min(compress_min),
+#endif
+        m_journal_options(journal)
+    {
+    }
+
+    ~Storage() {
+        stop_snapshots();
+        m_journal.reset();
+        delete m_segment; m_segment = nullptr;
+    }
+
+    std::size_t shards_count() const { return m_shards.size(); }
+
+    // Bytes of storage file taken by items, indexes and free blocks of slabs.
+    std::size_t memory_used()
+    {
+        std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+        return m_segment->get_size() - m_segment->get_free_memory();
+    }
+
+    // Bytes of items in slabs of all shards, the memory limit is for them.
+    std::size_t items_memory()
+    {
+        std::size_t used = 0;
+        for (auto& shard : m_shards) {
+            std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+            std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+            used += shard.slab->used();
+        }
+        return used;
+    }
+
+    std::size_t memory_limit() const { return m_memory_limit; }
+    std::size_t compress_min() const { return m_compress_min; }
+
+    // Journal of changes, nullptr when it is off.
+    Journal* journal() { return m_journal.get(); }
+
+    // Changes can not be made durable any more.
+    bool journal_failed() const { return m_journal && m_journal->failed(); }
+
+    // Clock of expiry times.
+    static std::uint32_t clock_now() { return (std::uint32_t)std::time(nullptr); }
+
+    // Execute one command of protocol.
+    // Return protocol::Status, value of GET is appended to result: key and 
+    // value may point right into the input buffer of connection, result may 
+    // be its output buffer, so GET makes the only copy of value.
+    // LSN of journal record of change is placed to lsn, 0 if nothing is changed.
+    // Version of key after the command is placed to version, 0 if it is absent.
+    // Flags are protocol::RequestFlags of request, protocol::ResponseFlags
+    // of answer are placed to answer_flags.
+    // Storage keeps no state of request, so it may be called from any thread.
+    int execute(
+        std::uint8_t       opcode, 
+        boost::string_view key, 
+        boost::string_view val, 
+        std::string*       result, 
+        std::uint64_t*     lsn          = nullptr,
+        std::uint64_t*     version      = nullptr,
+        std::uint8_t       flags        = 0,
+        std::uint8_t*      answer_flags = nullptr)
+    {
+        if (lsn) *lsn = 0;
+        if (version) *version = 0;
+        if (answer_flags) *answer_flags = 0;
+        if (protocol::is_change(opcode) && journal_failed()) return protocol::StatusFailed;
+
+        // New value is compressed before the lock of shard is taken.
+        std::string        packed;
+        const std::string* pack = nullptr;
+        if (opcode == protocol::OpInsert || opcode == protocol::OpUpdate || opcode == protocol::OpCas) {
+            std::size_t params = (flags & protocol::RequestTtl ? protocol::ttl_params_size : 0) +
+                                 (opcode == protocol::OpCas ? protocol::cas_params_size : 0);
+            pack = pack_value(val.substr(std::min(params, val.size())), packed);
+        }
+        return with_shard(key, opcode != protocol::OpGet, key.size() + val.size(), 
+            [&](StorageShard& shard) { 
+                return docommand(shard, opcode, flags, key, val, pack, result, lsn, version, answer_flags); 
+            });
+    }
+
+    // One step of deletion of expired items, it is called by timer of server.
+    // Every shard is locked once for about m_expire_budget items: the sweep
+    // after start puts items with TTL into the timer wheel, then the due
+    // entries of wheel are deleted. Return true when work is left, the next
+    // step goes on with it.
+    bool expire_step()
+    {
+        std::uint32_t now  = clock_now();
+        bool          more = false;
+        for (auto& shard : m_shards) {
+            std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+            std::unique_lock<std::shared_timed_mutex> lock(shard.mtx);
+            if (!shard.swept) {
+                walk_shard(*shard.container, shard.sweep, m_expire_budget, [&](const StorageItem& item) {
+                    boost::string_view key = item.key();
+                    if (item.m_expire) shard.wheel.add(item.m_expire, std::string(key.data(), key.size()));
+                });
+                shard.swept = shard.sweep.done;
+                more = more || !shard.swept;
+            }
+            const StorageIndK& ik = shard.container->get<StorageItem::IndByK>();
+            bool done = shard.wheel.advance(now, m_expire_budget, [&](std::uint64_t deadline, const std::string& key) {
+                // Entry of key changed since then is stale.
+                StorageIteratorK itk = find_item(shard, key);
+                if (itk != ik.end() && itk->m_expire == deadline) {
+                    drop_item(shard, itk, nullptr);
+                    ++stat.expired;
+                }
+            });
+            more = more || !done;
+        }
+        return more;
+    }
+
+    // Execute MGET, MSET or MDELETE: every item like GET, INSERT or UPDATE, 
+    // DELETE. Shards of all keys are locked once, in the order of their 
+    // numbers, so concurrent batches never deadlock. Result of every item 
+    // (protocol::BatchResultHeader and value of MGET) is appended to result,
+    // results of MGET take at most protocol::max_batch_length bytes.
+    // LSN of the last journal record of batch is placed to lsn.
+    int execute_batch(
+        std::uint8_t                           opcode,
+        const std::vector<protocol::BatchItem>& items,
+        std::string*                           result,
+        std::uint64_t*                         lsn = nullptr)
+    {
+        if (lsn) *lsn = 0;
+        if (!protocol::is_batch(opcode)) return protocol::StatusBadRequest;
+        bool exclusive = opcode != protocol::OpMGet;
+        if (exclusive && journal_failed()) return protocol::StatusFailed;
+
+        // Values of MSET are compressed before the locks are taken, value
+        // which stays plain has an empty string here.
+        std::vector<std::string> packed(opcode == protocol::OpMSet ? items.size() : 0);
+        for (std::size_t i = 0; i < packed.size(); ++i) pack_value(items[i].value, packed[i]);
+
+        // Items before done are executed. Locks are taken again only when 
+        // the segment is full: it is grown and the rest of batch goes on.
+        std::size_t start = result->size();
+        std::size_t done  = 0;
+        while (done < items.size()) {
+            std::size_t size = 0, need = 0;
+            try {
+                std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+                size = m_segment->get_size();
+                ShardLocks locks(m_shards, exclusive);
+                for (std::size_t i = done; i < items.size(); ++i) locks.add(shard_index(items[i].key));
+                locks.lock();
+
+                for (; done < items.size(); ++done) {
+                    const protocol::BatchItem& item = items[done];
+                    need = item.key.size() + item.value.size();
+                    std::size_t pos = result->size();
+                    result->resize(pos + protocol::batch_result_size);
+                    const std::string* pack = done < packed.size() && !packed[done].empty() ? &packed[done] : nullptr;
+                    int status = docommand_item(m_shards[shard_index(item.key)], opcode, item, pack, result, lsn);
+                    // Value is left out when results of the rest would not fit.
+                    std::size_t rest = (items.size() - done - 1) * protocol::batch_result_size;
+                    if (opcode == protocol::OpMGet && result->size() - start + rest > protocol::max_batch_length) {
+                        result->resize(pos + protocol::batch_result_size);
+                        status = protocol::StatusTooLarge;
+                    }
+                    end_batch_result(result, pos, status);
+                }
+            }
+            catch (const boost::interprocess::bad_alloc&) {
+                // Segment is full: item done is not executed and has no result.
+            }
+            if (done == items.size()) break;
+            if (!grow(size, need)) {
+                for (; done < items.size(); ++done) {
+                    std::size_t pos = result->size();
+                    result->resize(pos + protocol::batch_result_size);
+                    end_batch_result(result, pos, protocol::StatusFailed);
+                }
+            }
+        }
+        return protocol::StatusOk;
+    }
+
+    // Append next items of scan to result as protocol::BatchItemHeader, key,
+    // value: at least one item unless the scan is done, about max_bytes.
+    int scan_chunk(StorageScan& scan, std::string* result, std::size_t max_bytes)
+    {
+#if defined(STORAGE_HASHED_KEYS)
+        // Keys are not ordered in this layout.
+        scan.done = true;
+        return protocol::StatusBadRequest;
+#else
+        if (scan.shards.size() != m_shards.size()) scan.shards.resize(m_shards.size());
+        std::size_t start = result->size();
+        while (!scan.done && result->size() - start < max_bytes) {
+            if (!scan.left) {
+                scan.done = scan.truncated = true;
+                break;
+            }
+            // Shard with the least next key.
+            StorageScan::ShardBuffer* best = nullptr;
+            for (std::size_t i = 0; i < m_shards.size(); ++i) {
+                auto& b = scan.shards[i];
+                if (b.items.empty() && !b.exhausted) refill_scan(scan, i);
+                if (b.items.empty()) continue;
+                if (!best || b.items.front().first < best->items.front().first) best = &b;
+            }
+            if (!best) {
+                scan.done = true;
+                break;
+            }
+
+            auto& item = best->items.front();
+            protocol::BatchItemHeader h;
+            h.key_length   = (std::uint16_t)item.first.size();
+            h.value_length = (std::uint32_t)item.second.size();
+            char buf[protocol::batch_item_size];
+            protocol::encode(h, buf);
+            result->append(buf, sizeof(buf)).append(item.first).append(item.second);
+            best->items.pop_front();
+            --scan.left;
+        }
+        return protocol::StatusOk;
+#endif
+    }
+
+    // Append next items of copy to result as journal records with LSN 0,
+    // about max_bytes. Every shard is locked shared for one chunk only.
+    void copy_chunk(StorageCopy& copy, std::string* result, std::size_t max_bytes)
+    {
+        std::size_t   start = result->size();
+        std::uint32_t now   = clock_now();
+        std::string   buf;
+        while (copy.shard < m_shards.size() && result->size() - start < max_bytes) {
+            std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+            std::shared_lock<std::shared_timed_mutex> lock(m_shards[copy.shard].mtx);
+            walk_shard(*m_shards[copy.shard].container, copy.cursor, m_snapshot_chunk, [&](const StorageItem& item) {
+                if (item.expired(now)) return;
+                JournalRecordHeader h;
+                h.type    = JournalPut;
+                h.version = item.m_version;
+                h.expire  = item.m_expire;
+                append_record(*result, h, item.key(), plain_value(item, buf));
+            });
+            if (copy.cursor.done) {
+                ++copy.shard;
+                copy.cursor = ShardCursor();
+            }
+        }
+        copy.done = copy.shard == m_shards.size();
+    }
+
+    // Delete all items, replica does it before it takes a new copy. 
+    // Deletions are not journaled.
+    void clear()
+    {
+        for (auto& shard : m_shards) {
+            std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+            std::unique_lock<std::shared_timed_mutex> lock(shard.mtx);
+            const StorageIndK& ik = shard.container->get<StorageItem::IndByK>();
+            while (!ik.empty()) erase_item(shard, ik.begin());
+            shard.wheel.reset(clock_now());
+        }
+        stat.entries = 0;
+    }
+
+    // Record of journal of primary, applied by replica.
+    void replicate(std::uint8_t type, boost::string_view key, boost::string_view val, 
+                   std::uint64_t version, std::uint32_t expire)
+    {
+        apply_record(type, key, val, version, expire);
+    }
+
+    // Open storage file, or create it when it does not exist.
+    // Replay journal records which are not in the file yet.
+    int load (const std::string& file_path)
+    {
+        if (file_path.length()) m_file_path = file_path;
+        if (!m_file_path.length()) return -1;
+
+        bool use_journal = m_journal_options.sync != JournalSync::Off;
+        bool fresh;
+        if (!open_file(fresh)) return -1;
+
+        if (m_header->layout != storage_layout) {
+            logger().write(LogLevel::Error, "Storage file has layout %u, server is built for %u.", 
+                           m_header->layout, storage_layout);
+            logger().write(LogLevel::Error, "Remove it to rebuild the file from snapshot and journal.");
+            return -1;
+        }
+        if (!fresh && !m_header->clean) {
+            logger().write(LogLevel::Warning, "Storage file was not closed cleanly.");
+            // Content of file after crash can not be trusted, journal is.
+            if (use_journal && m_header->journaled) {
+                logger().write(LogLevel::Info, "Storage file is rebuilt from journal.");
+                delete m_segment; m_segment = nullptr;
+                file_mapping::remove(m_file_path.c_str());
+                if (!open_file(fresh)) return -1;
+            }
+        }
+
+        // Data is already partitioned by the number of shards in the file.
+        if (fresh) {
+            m_header->shards    = m_shards_count;
+            m_header->journaled = use_journal;
+        }
+        else if (m_header->shards != m_shards_count) {
+            logger().write(LogLevel::Warning, "Storage file has %u shards, it is used.", m_header->shards);
+        }
+        m_shards = std::vector<StorageShard>(m_header->shards);
+        attach_shards();
+        for (auto& shard : m_shards) shard.wheel.reset(clock_now());
+
+        if (use_journal) m_journal.reset(new Journal(m_file_path + ".journal", m_journal_options));
+
+        // New file starts from the latest snapshot, journal goes on from it.
+        if (fresh) {
+            std::uint64_t lsn = 0, version = 0;
+            auto read = read_snapshot(snapshot_path(), lsn, version, 
+                [this](const std::string& key, const std::string& val, std::uint64_t v, std::uint32_t expire) {
+                    apply_record(JournalPut, key, val, v, expire);
+                });
+            if (read == SnapshotRead::Loaded) {
+                logger().write(LogLevel::Info, "Snapshot of LSN %llu is loaded.", (unsigned long long)lsn);
+            }
+            else if (read == SnapshotRead::Damaged) {
+                // Segments covered by the snapshot may be removed already:
+                // the whole journal from LSN 1 is the only other source.
+                if (!m_journal || m_journal->first_lsn() != 1) {
+                    logger().write(LogLevel::Error, "Journal has no changes before the snapshot, they would be lost.");
+                    logger().write(LogLevel::Error, "Restore the snapshot, or remove it to start without them.");
+                    return -1;
+                }
+                logger().write(LogLevel::Warning, "Storage is rebuilt from the whole journal.");
+            }
+            m_header->lsn = lsn;
+            // Versions of keys deleted before snapshot are not given again.
+            if (version > m_header->version) m_header->version = version;
+        }
+
+        if (use_journal) {
+            auto last = m_journal->replay(m_header->lsn, 
+                [this](std::uint8_t type, const std::string& key, const std::string& val, 
+                       std::uint64_t version, std::uint32_t expire) {
+                    apply_record(type, key, val, version, expire);
+                });
+            if (!m_journal->open(std::max(last, m_header->lsn) + 1)) return -1;
+            if (m_journal_options.snapshot_size) 
+                m_snapshot_thread = std::thread([this] { snapshot_loop(); });
+        }
+        else {
+            // Changes of this run will be missing in journal.
+            m_header->journaled = false;
+        }
+
+        // Later the count is kept by INSERT and DELETE.
+        std::int64_t entries = 0;
+        for (auto& shard : m_shards) entries += shard.container->size();
+        stat.entries = entries;
+
+        // Keys with TTL of the file get into timer wheels by sweep.
+        for (auto& shard : m_shards) shard.swept = !m_header->ttl_used;
+
+        m_header->clean = false;
+        m_segment->flush();
+        return 0;
+    }
+
+    // Write journal, flush storage file and mark it as cleanly closed.
+    int save(const std::string& file_path = "")
+    {
+        if (file_path.length() && file_path != m_file_path) return -1;
+        if (!m_segment) return -1;
+
+        stop_snapshots();
+        std::unique_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+        if (m_journal) {
+            m_journal->close();
+            m_header->lsn = m_journal->last_lsn();
+        }
+        m_header->clean = true;
+        return m_segment->flush() ? 0 : -1;
+    }
+
+    // Write snapshot of all shards, then remove journal segments it covers.
+    // Shards are locked for reading by short chunks, commands are not stopped.
+    bool make_snapshot()
+    {
+        if (!m_journal) return false;
+        std::lock_guard<std::mutex> guard(m_snapshot_mtx);
+
+        // Every change up to this LSN is already in the shards.
+        auto lsn      = m_journal->last_lsn();
+        auto appended = m_journal->appended_bytes();
+        std::uint64_t version;
+        {
+            std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+            version = m_header->version;
+        }
+        SnapshotWriter writer(snapshot_path());
+        if (!writer.open(lsn, version)) return false;
+        std::uint32_t now = clock_now();
+        std::string   buf;
+
+        for (std::size_t i = 0; i < m_shards.size(); ++i) {
+            ShardCursor cursor;
+            while (!cursor.done) {
+                {
+                    std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+                    std::shared_lock<std::shared_timed_mutex> lock(m_shards[i].mtx);
+                    walk_shard(*m_shards[i].container, cursor, m_snapshot_chunk, [&](const StorageItem& item) {
+                        if (item.expired(now)) return;
+                        boost::string_view key = item.key(), val = plain_value(item, buf);
+                        writer.add(key.data(), key.size(), val.data(), val.size(), item.m_version, item.m_expire);
+                    });
+                }
+                if (!writer.flush()) return false;
+            }
+        }
+        if (!writer.commit()) {
+            logger().write(LogLevel::Error, "Snapshot is not written.");
+            return false;
+        }
+
+        {
+            // Now snapshot and journal hold every change of the file.
+            std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+            m_header->journaled = true;
+        }
+        m_snapshot_appended = appended;
+        logger().write(LogLevel::Info, "Snapshot of LSN %llu is written: %llu items.", 
+                       (unsigned long long)lsn, (unsigned long long)writer.count());
+        m_journal->roll();
+        m_journal->remove_segments(lsn);
+        return true;
+    }
+
+private:
+    std::string snapshot_path() const { return m_file_path + ".snapshot"; }
+
+    // Background thread: snapshot when enough is appended to journal.
+    void snapshot_loop()
+    {
+        std::unique_lock<std::mutex> lock(m_snapshot_thread_mtx);
+        while (!m_snapshot_stop) {
+            m_snapshot_cv.wait_for(lock, std::chrono::seconds(1));
+            if (m_snapshot_stop) break;
+            if (m_journal->appended_bytes() - m_snapshot_appended < m_journal_options.snapshot_size) continue;
+            lock.unlock();
+            make_snapshot();
+            lock.lock();
+        }
+    }
+
+    void stop_snapshots()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_snapshot_thread_mtx);
+            m_snapshot_stop = true;
+        }
+        m_snapshot_cv.notify_all();
+        if (m_snapshot_thread.joinable()) m_snapshot_thread.join();
+    }
+
+    std::size_t shard_index(boost::string_view key) const
+    {
+        return StringHash()(key) % m_shards.size();
+    }
+
+    StorageShard& shard_of(boost::string_view key)
+    {
+        return m_shards[shard_index(key)];
+    }
+
+    // Locks of several shards, taken in the order of shard numbers.
+    class ShardLocks {
+        std::vector<StorageShard>& m_shards;
+        bool                       m_exclusive;
+        std::vector<std::size_t>   m_indexes;
+        std::size_t                m_locked = 0;
+
+    public:
+        ShardLocks(std::vector<StorageShard>& shards, bool exclusive) : 
+            m_shards(shards), m_exclusive(exclusive) {}
+
+        ~ShardLocks()
+        {
+            while (m_locked) {
+                auto& mtx = m_shards[m_indexes[--m_locked]].mtx;
+                if (m_exclusive) mtx.unlock();
+                else             mtx.unlock_shared();
+            }
+        }
+
+        void add(std::size_t index) { m_indexes.push_back(index); }
+
+        void lock()
+        {
+            std::sort(m_indexes.begin(), m_indexes.end());
+            m_indexes.erase(std::unique(m_indexes.begin(), m_indexes.end()), m_indexes.end());
+            for (; m_locked < m_indexes.size(); ++m_locked) {
+                auto& mtx = m_shards[m_indexes[m_locked]].mtx;
+                if (m_exclusive) mtx.lock();
+                else             mtx.lock_shared();
+            }
+        }
+    };
+
+#if !defined(STORAGE_HASHED_KEYS)
+    // Copy next items of shard to the buffer of scan, under short lock.
+    void refill_scan(StorageScan& scan, std::size_t index)
+    {
+        auto& b = scan.shards[index];
+        std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+        std::shared_lock<std::shared_timed_mutex> lock(m_shards[index].mtx);
+
+        const StorageIndK& ik = m_shards[index].container->get<StorageItem::IndByK>();
+        StorageIteratorK   it = b.started ? ik.upper_bound(b.last) :
+                                scan.after ? ik.upper_bound(scan.from) : ik.lower_bound(scan.from);
+        b.started = true;
+        std::size_t   bytes = 0;
+        std::uint32_t now   = clock_now();
+        std::string   buf;
+        for (std::size_t n = 0; n < m_scan_buffer_items && bytes < m_scan_buffer_bytes; ++n, ++it) {
+            if (it == ik.end()) break;
+            boost::string_view key = it->key();
+            // Keys with prefix go together, the first other key ends them.
+            if (!key.starts_with(scan.prefix)) {
+                b.exhausted = true;
+                return;
+            }
+            b.last.assign(key.data(), key.size());
+            if (it->expired(now)) continue;
+            boost::string_view val = plain_value(*it, buf);
+            b.items.emplace_back(std::string(key.data(), key.size()), std::string(val.data(), val.size()));
+            bytes += key.size() + val.size();
+        }
+        if (it == ik.end()) b.exhausted = true;
+    }
+#endif
+
+    // Fill result header of batch item, its value is everything after it.
+    static void end_batch_result(std::string* result, std::size_t pos, int status)
+    {
+        protocol::BatchResultHeader h;
+        h.status = (std::uint8_t)status;
+        h.length = (std::uint32_t)(result->size() - pos - protocol::batch_result_size);
+        protocol::encode(h, &(*result)[pos]);
+    }
+
+    // Open or create storage file, fresh is set for the new one.
+    bool open_file(bool& fresh)
+    {
+        try {
+            m_segment = new managed_mapped_file(open_or_create, m_file_path.c_str(), m_initial_size);
+            fresh     = !m_segment->find<StorageHeader>("StorageHeader").first;
+            m_header  = m_segment->find_or_construct<StorageHeader>("StorageHeader")();
+        }
+        catch (const interprocess_exception& e) {
+            logger().write(LogLevel::Error, "Storage file \"%s\": %s", m_file_path.c_str(), e.what());
+            return false;
+        }
+        return true;
+    }
+
+    void attach_shards()
+    {
+        for (std::size_t i = 0; i < m_shards.size(); ++i) {
+            auto name = "StorageSlab" + std::to_string(i);
+            m_shards[i].slab = m_segment->find_or_construct<ShardSlab>(name.c_str())();
+            name = "StorageContainer" + std::to_string(i);
+            m_shards[i].container = m_segment->find_or_construct<StorageContainer>(name.c_str())(
+                StorageContainer::allocator_type(m_shards[i].slab, m_segment->get_segment_manager()));
+#if defined(STORAGE_SWISS_INDEX)
+            name = "StorageSwiss" + std::to_string(i);
+            m_shards[i].swiss = m_segment->find_or_construct<SwissKeyIndex>(name.c_str())();
+#endif
+        }
+    }
+
+    // Run f(shard) under the lock of shard of key: shared or exclusive.
+    // When the segment is full it is grown and f is run again, so f must
+    // not make its change when allocation fails. Only deletions of expired
+    // and evicted items may be done by then: they are journaled and stay,
+    // the next run does not find those items.
+    template<typename F>
+    int with_shard(boost::string_view key, bool exclusive, std::size_t need, F f)
+    {
+        for (;;) {
+            std::size_t size = 0;
+            try {
+                std::shared_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+                StorageShard& shard = shard_of(key);
+                size = m_segment->get_size();
+
+                if (!exclusive) {
+                    std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+                    return f(shard);
+                }
+                std::unique_lock<std::shared_timed_mutex> lock(shard.mtx);
+                return f(shard);
+            }
+            catch (const boost::interprocess::bad_alloc&) {
+                // Segment is full, nothing is changed.
+            }
+            if (!grow(size, need)) return protocol::StatusFailed;
+        }
+    }
+
+    // Grow the file at least twice, unless another thread has done it
+    // already since the failed command had seen segment of old_size.
+    bool grow(std::size_t old_size, std::size_t need)
+    {
+        std::unique_lock<std::shared_timed_mutex> segment_lock(m_segment_mtx);
+        if (m_segment->get_size() != old_size) return true;
+
+        std::size_t extra = std::max(old_size, 4 * need);
+        delete m_segment; m_segment = nullptr;
+        bool ok = managed_mapped_file::grow(m_file_path.c_str(), extra);
+        m_segment = new managed_mapped_file(open_only, m_file_path.c_str());
+        m_header  = m_segment->find<StorageHeader>("StorageHeader").first;
+        attach_shards();
+        logger().write(LogLevel::Info, "Storage file is grown to %zu bytes.", m_segment->get_size());
+        return ok;
+    }
+
+    // Block of slab for key and value, null when they fit in place.
+    char* allocate_block(StorageShard& shard, std::size_t size)
+    {
+        if (StorageItem::in_place(size)) return nullptr;
+        return shard.slab->allocate(m_segment->get_segment_manager(), size);
+    }
+
+    void free_block(StorageShard& shard, char* block, std::size_t size)
+    {
+        if (block) shard.slab->deallocate(m_segment->get_segment_manager(), block, size);
+    }
+
+    // Item of key, or end of index.
+    StorageIteratorK find_item(StorageShard& shard, boost::string_view key)
+    {
+        const StorageIndK& ik = shard.container->get<StorageItem::IndByK>();
+#if defined(STORAGE_SWISS_INDEX)
+        const StorageItem* item = shard.swiss->find(key, SwissKeyIndex::hash(key));
+        return item ? ik.iterator_to(*item) : ik.end();
+#else
+        return ik.find(key);
+#endif
+    }
+
+    // Value compressed to packed when it is long enough and gets shorter by
+    // it. Return packed, or nullptr when the value is kept plain.
+    const std::string* pack_value(boost::string_view val, std::string& packed)
+    {
+        if (!m_compress_min || val.size() < m_compress_min) return nullptr;
+        if (!protocol::compress_value(val, packed)) return nullptr;
+        ++stat.compressed;
+        return &packed;
+    }
+
+    // Plain value of item, compressed one is unpacked to buf.
+    static boost::string_view plain_value(const StorageItem& item, std::string& buf)
+    {
+        if (!item.compressed()) return item.value();
+        buf.clear();
+        protocol::uncompress_value(item.value(), buf);
+        return buf;
+    }
+
+    // Item has the value given plain and, maybe, packed.
+    static bool same_value(const StorageItem& item, boost::string_view val, const std::string* packed)
+    {
+        if (item.compressed() == (packed != nullptr)) return item.value() == (packed ? boost::string_view(*packed) : val);
+        std::string buf;
+        return plain_value(item, buf) == val;
+    }
+
+    // New item, nothing is left when allocation fails. Value is kept
+    // packed when it is given.
+    bool insert_item(StorageShard& shard, boost::string_view key, boost::string_view val, 
+                     const std::string* packed, std::uint64_t version, std::uint32_t expire)
+    {
+#if defined(STORAGE_SWISS_INDEX)
+        // Room in hash index first: insert into it can not fail then.
+        shard.swiss->reserve(m_segment->get_segment_manager(), shard.container->size() + 1);
+#endif
+        std::uint8_t flags = packed ? StorageItem::ItemCompressed : 0;
+        if (packed) val = *packed;
+        std::size_t size  = key.size() + val.size();
+        char*       block = allocate_block(shard, size);
+        std::pair<StorageContainer::iterator, bool> r;
+        try {
+            r = shard.container->emplace(key, val, block, version, expire, flags);
+        }
+        catch (...) {
+            free_block(shard, block, size);
+            throw;
+        }
+        if (!r.second) {
+            free_block(shard, block, size);
+            return false;
+        }
+#if defined(STORAGE_SWISS_INDEX)
+        shard.swiss->insert(&*r.first, SwissKeyIndex::hash(key));
+#endif
+        return true;
+    }
+
+    void erase_item(StorageShard& shard, StorageIteratorK itk)
+    {
+        char*       block = itk->m_block.get();
+        std::size_t size  = itk->size();
+#if defined(STORAGE_SWISS_INDEX)
+        shard.swiss->erase(&*itk, SwissKeyIndex::hash(itk->key()));
+#endif
+        shard.container->erase(itk);
+        free_block(shard, block, size);
+    }
+
+    // Replace value of existing item, the new block is allocated first.
+    void put_value(StorageShard& shard, StorageIteratorK itk, boost::string_view val, 
+                   const std::string* packed, std::uint64_t version, std::uint32_t expire)
+    {
+        std::uint8_t flags = packed ? StorageItem::ItemCompressed : 0;
+        if (packed) val = *packed;
+        char*       old_block = itk->m_block.get();
+        std::size_t old_size  = itk->size();
+        char*       block     = allocate_block(shard, itk->m_key_size + val.size());
+        shard.container->get<StorageItem::IndByK>().modify(itk, 
+            StorageItem::ValChange(val, block, version, expire, flags));
+        free_block(shard, old_block, old_size);
+    }
+
+    // Key gets into timer wheel of its shard.
+    void schedule_expiry(StorageShard& shard, boost::string_view key, std::uint32_t expire)
+    {
+        if (!expire) return;
+        shard.wheel.add(expire, std::string(key.data(), key.size()));
+        m_header->ttl_used = true;
+    }
+
+    // Delete expired or evicted item, the deletion is journaled as DELETE.
+    void drop_item(StorageShard& shard, StorageIteratorK itk, std::uint64_t* lsn)
+    {
+        std::uint64_t v = ++m_header->version;
+        if (m_journal) {
+            auto n = m_journal->append(JournalErase, itk->key(), boost::string_view(), v, 0);
+            if (lsn) *lsn = std::max(*lsn, n);
+        }
+        erase_item(shard, itk);
+        --stat.entries;
+    }
+
+    // Evict items of shard by CLOCK until need bytes more fit into its part
+    // of the memory limit. Item of key keep stays: it is being changed.
+    // Expired items go first of all. Two rounds of hand clear all bits, so
+    // then either enough is evicted or only keep is left.
+    void make_room(StorageShard& shard, std::size_t need, boost::string_view keep, std::uint64_t* lsn)
+    {
+        std::size_t limit = m_memory_limit / m_shards.size();
+        if (!m_memory_limit || shard.slab->used() + need <= limit) return;
+
+        const StorageIndK& ik    = shard.container->get<StorageItem::IndByK>();
+        std::uint32_t      now   = clock_now();
+#if defined(STORAGE_HASHED_KEYS)
+        std::size_t        steps = 2 * ik.bucket_count() + 2;
+#else
+        std::size_t        steps = 2 * ik.size() + 2;
+#endif
+        auto visit = [&](const StorageItem& item) {
+            if (item.key() == keep) return;
+            if (item.expired(now)) {
+                drop_item(shard, ik.iterator_to(item), lsn);
+                ++stat.expired;
+            }
+            else if (item.m_referenced.load(std::memory_order_relaxed)) {
+                item.m_referenced.store(0, std::memory_order_relaxed);
+            }
+            else {
+                drop_item(shard, ik.iterator_to(item), lsn);
+                ++stat.evicted;
+            }
+        };
+        ShardCursor& hand = shard.hand;
+        while (shard.slab->used() + need > limit && steps-- && !ik.empty()) {
+#if defined(STORAGE_HASHED_KEYS)
+            // Hand goes by buckets, items of bucket are visited together.
+            std::size_t b = hand.bucket++ % ik.bucket_count();
+            for (auto it = ik.begin(b); it != ik.end(b); ) visit(*it++);
+#else
+            StorageIteratorK it = hand.started ? ik.upper_bound(hand.last_key) : ik.begin();
+            if (it == ik.end()) it = ik.begin();
+            hand.started = true;
+            boost::string_view key = it->key();
+            hand.last_key.assign(key.data(), key.size());
+            visit(*it);
+#endif
+        }
+    }
+
+    // Apply record of journal at start of server.
+    void apply_record(std::uint8_t type, boost::string_view key, boost::string_view val, 
+                      std::uint64_t version, std::uint32_t expire)
+    {
+        std::string        packed;
+        const std::string* pack = type == JournalPut ? pack_value(val, packed) : nullptr;
+        with_shard(key, true, key.size() + val.size(), [&](StorageShard& shard) -> int {
+            const StorageIndK& ik  = shard.container->get<StorageItem::IndByK>();
+            StorageIteratorK   itk = find_item(shard, key);
+            if (type == JournalErase) {
+                if (itk == ik.end()) return protocol::StatusOk;
+                erase_item(shard, itk);
+                --stat.entries;
+            }
+            else if (type == JournalExpire) {
+                if (itk == ik.end()) return protocol::StatusOk;
+                shard.container->get<StorageItem::IndByK>().modify(itk, StorageItem::ExpireChange(expire));
+            }
+            else if (itk == ik.end()) {
+                if (insert_item(shard, key, val, pack, version, expire)) ++stat.entries;
+            }
+            else {
+                put_value(shard, itk, val, pack, version, expire);
+            }
+            if (version > m_header->version) m_header->version = version;
+            if (expire) schedule_expiry(shard, key, expire);
+            return protocol::StatusOk;
+        });
+    }
+
+    // One item of batch, caller holds the lock of its shard.
+    // On bad_alloc the result of item is removed, nothing is changed.
+    int docommand_item(
+        StorageShard&              shard,
+        std::uint8_t               opcode,
+        const protocol::BatchItem& item,
+        const std::string*         packed,
+        std::string*               result,
+        std::uint64_t*             lsn)
+    {
+        std::uint64_t n = 0;
+        int status = protocol::StatusBadRequest;
+        try {
+            switch (opcode) {
+            case protocol::OpMGet:
+                status = docommand(shard, protocol::OpGet, 0, item.key, item.value, nullptr, result, &n, nullptr, nullptr);
+                break;
+            case protocol::OpMSet: {
+                const StorageIndK& ik  = shard.container->get<StorageItem::IndByK>();
+                StorageIteratorK   itk = find_item(shard, item.key);
+                auto op = itk == ik.end() || itk->expired(clock_now()) ? protocol::OpInsert : protocol::OpUpdate;
+                status = docommand(shard, op, 0, item.key, item.value, packed, result, &n, nullptr, nullptr);
+                break;
+            }
+            case protocol::OpMDelete:
+                status = docommand(shard, protocol::OpDelete, 0, item.key, item.value, nullptr, result, &n, nullptr, nullptr);
+                break;
+            }
+        }
+        catch (const boost::interprocess::bad_alloc&) {
+            result->resize(result->size() - protocol::batch_result_size);
+            throw;
+        }
+        if (lsn) *lsn = std::max(*lsn, n);
+        return status;
+    }
+
+    // Caller holds the lock of shard: shared for GET, exclusive otherwise.
+    // Version of key is placed to version: the current one when the command
+    // fails, the new one after the change. Packed is the new value of
+    // INSERT, UPDATE or CAS compressed, nullptr when it is kept plain.
+    int docommand(
+        StorageShard&      shard,
+        std::uint8_t       opcode,
+        std::uint8_t       flags,
+        boost::string_view key,
+        boost::string_view val,
+        const std::string* packed,
+        std::string*       result,
+        std::uint64_t*     lsn,
+        std::uint64_t*     version,
+        std::uint8_t*      answer_flags)
+    {
+        auto exit_error = [&] (int status, std::atomic<unsigned int>& count) -> int {
+            ++count;
+            return status;
+        };
+        auto journal = [&] (std::uint8_t type, boost::string_view value, std::uint64_t v, std::uint32_t expire) {
+            if (!m_journal) return;
+            auto n = m_journal->append(type, key, value, v, expire);
+            if (lsn) *lsn = std::max(*lsn, n);
+        };
+
+        // TTL goes first in value, EXPIRE has nothing else.
+        std::uint32_t now    = clock_now();
+        std::uint32_t expire = 0;
+        bool          ttl    = (flags & protocol::RequestTtl) != 0 || opcode == protocol::OpExpire;
+        if (ttl) {
+            protocol::TtlParams params;
+            protocol::decode(params, val.data());
+            // Too long TTL keeps the key up to the last second of clock.
+            const std::uint32_t last = std::numeric_limits<std::uint32_t>::max();
+            if (params.ttl) expire = params.ttl > last - now ? last : now + params.ttl;
+            val    = val.substr(protocol::ttl_params_size);
+        }
+
+        // Expired item is absent. GET under shared lock leaves it to
+        // expire_step(), a change deletes it first.
+        const StorageIndK& ik  = shard.container->get<StorageItem::IndByK>();
+        StorageIteratorK   itk = find_item(shard, key);
+        if (itk != ik.end() && itk->expired(now)) {
+            if (opcode != protocol::OpGet) {
+                drop_item(shard, itk, lsn);
+                ++stat.expired;
+            }
+            itk = ik.end();
+        }
+        if (version) *version = itk != ik.end() ? itk->m_version : 0;
+        // Change without TTL keeps expiry time of item.
+        if (!ttl && itk != ik.end()) expire = itk->m_expire;
+
+        // CAS and CDELETE: expected version, value of CAS follows it.
+        std::uint64_t expected = 0;
+        if (opcode == protocol::OpCas || opcode == protocol::OpCDelete) {
+            protocol::CasParams params;
+            protocol::decode(params, val.data());
+            expected = params.version;
+            val      = val.substr(protocol::cas_params_size);
+        }
+
+        // Cache: room for the new value is made only when the command is
+        // sure to change the key, so a failed one evicts nothing.
+        auto room = [&] {
+            make_room(shard, key.size() + (packed ? packed->size() : val.size()) + m_item_overhead, key, lsn);
+        };
+
+        // Version is taken before the change: when allocation fails and the
+        // command is run again, the version is just skipped. DELETE takes
+        // one as well, so versions in journal are never repeated.
+        std::uint64_t v = 0;
+        switch (opcode) {
+        case protocol::OpInsert: {
+            if (itk != ik.end()) return exit_error(protocol::StatusExists, stat.failInsert);
+            room();
+            v = ++m_header->version;
+            if (!insert_item(shard, key, val, packed, v, expire)) return exit_error(protocol::StatusFailed, stat.failInsert);
+            journal(JournalPut, val, v, expire);
+            ++stat.successInsert;
+            ++stat.entries;
+            break;
+        }
+        case protocol::OpUpdate: {
+            if (itk == ik.end()) return exit_error(protocol::StatusNotFound, stat.failUpdate);
+            if (itk->m_expire == expire && same_value(*itk, val, packed)) return exit_error(protocol::StatusUnchanged, stat.failUpdate);
+            room();
+            v = ++m_header->version;
+            put_value(shard, itk, val, packed, v, expire);
+            journal(JournalPut, val, v, expire);
+            ++stat.successUpdate;
+            break;
+        }
+        case protocol::OpDelete: {
+            if (itk == ik.end()) return exit_error(protocol::StatusNotFound, stat.failDelete);
+            erase_item(shard, itk);
+            journal(JournalErase, boost::string_view(), ++m_header->version, 0);
+            ++stat.successDelete;
+            --stat.entries;
+            break;
+        }
+        case protocol::OpGet: {
+            if (itk == ik.end()) return exit_error(protocol::StatusNotFound, stat.failGet);
+            // Compressed value is sent as it is to client which accepts it.
+            if (result) {
+                boost::string_view value = itk->value();
+                if (!itk->compressed()) {
+                    result->append(value.data(), value.size());
+                }
+                else if ((flags & protocol::RequestCompressed) && answer_flags) {
+                    result->append(value.data(), value.size());
+                    *answer_flags |= protocol::ResponseCompressed;
+                    ++stat.compressedSent;
+                }
+                else {
+                    protocol::uncompress_value(value, *result);
+                }
+            }
+            itk->touch();
+            ++stat.successGet;
+            return protocol::StatusOk;
+        }
+        case protocol::OpCas: {
+            // Version 0 expects no key: INSERT if absent.
+            if (!expected) {
+                if (itk != ik.end()) return exit_error(protocol::StatusConflict, stat.failCas);
+                room();
+                v = ++m_header->version;
+                if (!insert_item(shard, key, val, packed, v, expire)) return exit_error(protocol::StatusFailed, stat.failCas);
+                ++stat.entries;
+            }
+            else {
+                if (itk == ik.end()) return exit_error(protocol::StatusNotFound, stat.failCas);
+                if (itk->m_version != expected) return exit_error(protocol::StatusConflict, stat.failCas);
+                room();
+                v = ++m_header->version;
+                put_value(shard, itk, val, packed, v, expire);
+            }
+            journal(JournalPut, val, v, expire);
+            ++stat.successCas;
+            break;
+        }
+        case protocol::OpCDelete: {
+            if (itk == ik.end()) return exit_error(protocol::StatusNotFound, stat.failCDelete);
+            if (itk->m_version != expected) return exit_error(protocol::StatusConflict, stat.failCDelete);
+            erase_item(shard, itk);
+            journal(JournalErase, boost::string_view(), ++m_header->version, 0);
+            ++stat.successCDelete;
+            --stat.entries;
+            break;
+        }
+        case protocol::OpExpire: {
+            // Expiry time is not a change of value: version stays.
+            if (itk == ik.end()) return exit_error(protocol::StatusNotFound, stat.failExpire);
+            v = itk->m_version;
+            shard.container->get<StorageItem::IndByK>().modify(itk, StorageItem::ExpireChange(expire));
+            journal(JournalExpire, boost::string_view(), v, expire);
+            ++stat.successExpire;
+            break;
+        }
+        default:
+            return protocol::StatusBadRequest;
+        }
+        if (expire && opcode != protocol::OpDelete && opcode != protocol::OpCDelete) schedule_expiry(shard, key, expire);
+        if (version) *version = v;
+        return protocol::StatusOk;
+    }
+};
+
+#endif // TCP_TEST_STORAGE_H
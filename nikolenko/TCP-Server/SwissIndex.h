@@ -0,0 +1,213 @@
+// SwissIndex.h
+// Open addressing hash index on keys of storage shard (Swiss table).
+//
+// Slots are in groups of 16 and every slot has a control byte: empty,
+// deleted, or 7 bits of hash of its key. One SSE2 compare checks control
+// bytes of a whole group, so lookup reads only the slots whose bits match,
+// and the hash stored in slot is compared before the key itself. Groups are
+// probed in triangular order, a group with an empty slot ends the probe.
+//
+// Table is kept at most 7/8 full, counting deleted slots. It is rebuilt by
+// the stored hashes when it grows or is full of deleted slots: keys are not
+// read again.
+//
+// The table lives in the segment of storage, as all of shard, and points to
+// items of the multi_index container of shard: nodes never move, so the
+// pointers stay valid until the item is erased. Caller locks the shard.
+
+#ifndef TCP_TEST_SWISS_INDEX_H
+#define TCP_TEST_SWISS_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include <boost/functional/hash.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/utility/string_view.hpp>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+template<typename Item, typename SegmentManager>
+class SwissIndex {
+public:
+    static const std::size_t group_size = 16;
+
+private:
+    static const std::int8_t m_empty   = -128;
+    static const std::int8_t m_deleted = -2;
+
+    struct Slot {
+        std::uint64_t                             hash;
+        boost::interprocess::offset_ptr<const Item> item;
+    };
+
+    boost::interprocess::offset_ptr<std::int8_t> m_ctrl;    // Control bytes of slots
+    boost::interprocess::offset_ptr<Slot>        m_slots;
+    std::size_t m_groups   = 0;     // Power of two
+    std::size_t m_size     = 0;
+    std::size_t m_tombs    = 0;     // Deleted slots
+
+public:
+    // Hash of key for the index. Keys of one shard have the same remainder
+    // of StringHash by number of shards, so its bits are mixed (fmix64).
+    static std::uint64_t hash(boost::string_view key)
+    {
+        std::uint64_t h = boost::hash_range(key.begin(), key.end());
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    std::size_t size()     const { return m_size; }
+    std::size_t capacity() const { return m_groups * group_size; }
+
+    const Item* find(boost::string_view key, std::uint64_t h) const
+    {
+        if (!m_groups) return nullptr;
+        std::size_t g = first_group(h);
+        for (std::size_t i = 1; ; ++i) {
+            const std::int8_t* ctrl = m_ctrl.get() + g * group_size;
+            for (std::uint32_t bits = match(ctrl, tag(h)); bits; bits &= bits - 1) {
+                const Slot& slot = m_slots[g * group_size + lowest_bit(bits)];
+                if (slot.hash == h && slot.item->key() == key) return slot.item.get();
+            }
+            if (match(ctrl, m_empty)) return nullptr;
+            g = (g + i) & (m_groups - 1);
+        }
+    }
+
+    // Room for n items, the table is rebuilt when it is needed. Allocation
+    // of segment may throw, the table is not changed then.
+    void reserve(SegmentManager* segment, std::size_t n)
+    {
+        if ((n + m_tombs) * 8 <= capacity() * 7) return;
+        // Table of the same size drops deleted slots, when they are many.
+        std::size_t groups = std::max<std::size_t>(m_groups, 1);
+        if (n * 32 > capacity() * 25) groups *= 2;
+        while (n * 8 > groups * group_size * 7) groups *= 2;
+        rehash(segment, groups);
+    }
+
+    // Item is not in the index, room for it is reserved.
+    void insert(const Item* item, std::uint64_t h)
+    {
+        std::size_t g = first_group(h);
+        for (std::size_t i = 1; ; ++i) {
+            std::uint32_t bits = match_free(m_ctrl.get() + g * group_size);
+            if (bits) {
+                std::size_t pos = g * group_size + lowest_bit(bits);
+                if (m_ctrl[pos] == m_deleted) --m_tombs;
+                m_ctrl[pos] = tag(h);
+                ::new (&m_slots[pos]) Slot();
+                m_slots[pos].hash = h;
+                m_slots[pos].item = item;
+                ++m_size;
+                return;
+            }
+            g = (g + i) & (m_groups - 1);
+        }
+    }
+
+    void erase(const Item* item, std::uint64_t h)
+    {
+        if (!m_groups) return;
+        std::size_t g = first_group(h);
+        for (std::size_t i = 1; ; ++i) {
+            std::int8_t* ctrl = m_ctrl.get() + g * group_size;
+            for (std::uint32_t bits = match(ctrl, tag(h)); bits; bits &= bits - 1) {
+                std::size_t pos = g * group_size + lowest_bit(bits);
+                if (m_slots[pos].item.get() != item) continue;
+                // No probe has passed a group with an empty slot, so the
+                // slot may be empty again. Otherwise it keeps probes going.
+                bool tomb = !match(ctrl, m_empty);
+                m_ctrl[pos] = tomb ? m_deleted : m_empty;
+                m_tombs += tomb;
+                --m_size;
+                return;
+            }
+            if (match(ctrl, m_empty)) return;
+            g = (g + i) & (m_groups - 1);
+        }
+    }
+
+private:
+    std::size_t first_group(std::uint64_t h) const { return (std::size_t)(h >> 7) & (m_groups - 1); }
+
+    static std::int8_t tag(std::uint64_t h) { return (std::int8_t)(h & 0x7f); }
+
+    // Bits of slots of group whose control byte is c.
+    static std::uint32_t match(const std::int8_t* group, std::int8_t c)
+    {
+#if defined(__SSE2__)
+        __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i*>(group));
+        return (std::uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+        std::uint32_t bits = 0;
+        for (std::size_t i = 0; i < group_size; ++i) bits |= (std::uint32_t)(group[i] == c) << i;
+        return bits;
+#endif
+    }
+
+    // Bits of empty and deleted slots of group: their sign bit is set.
+    static std::uint32_t match_free(const std::int8_t* group)
+    {
+#if defined(__SSE2__)
+        return (std::uint32_t)_mm_movemask_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(group)));
+#else
+        std::uint32_t bits = 0;
+        for (std::size_t i = 0; i < group_size; ++i) bits |= (std::uint32_t)(group[i] < 0) << i;
+        return bits;
+#endif
+    }
+
+    static std::size_t lowest_bit(std::uint32_t bits)
+    {
+#if defined(__GNUC__)
+        return (std::size_t)__builtin_ctz(bits);
+#else
+        std::size_t n = 0;
+        while (!(bits & 1)) bits >>= 1, ++n;
+        return n;
+#endif
+    }
+
+    void rehash(SegmentManager* segment, std::size_t groups)
+    {
+        std::size_t n     = groups * group_size;
+        Slot*       slots = static_cast<Slot*>(segment->allocate(n * sizeof(Slot)));
+        std::int8_t* ctrl;
+        try {
+            ctrl = static_cast<std::int8_t*>(segment->allocate_aligned(n, group_size));
+        }
+        catch (...) {
+            segment->deallocate(slots);
+            throw;
+        }
+        std::memset(ctrl, m_empty, n);
+
+        std::int8_t* old_ctrl   = m_ctrl.get();
+        Slot*        old_slots  = m_slots.get();
+        std::size_t  old_groups = m_groups;
+        m_ctrl   = ctrl;
+        m_slots  = slots;
+        m_groups = groups;
+        m_size   = 0;
+        m_tombs  = 0;
+        for (std::size_t pos = 0; pos < old_groups * group_size; ++pos) {
+            if (old_ctrl[pos] >= 0) insert(old_slots[pos].item.get(), old_slots[pos].hash);
+        }
+        if (old_ctrl) {
+            segment->deallocate(old_ctrl);
+            segment->deallocate(old_slots);
+        }
+    }
+};
+
+#endif // TCP_TEST_SWISS_INDEX_H
@@ -1,537 +1,1108 @@
-// testboost.cpp : Этот файл содержит функцию "main". Здесь начинается и заканчивается выполнение программы.
-//
-
-// Nikolenko.cpp
-
-// Реализовать небольшую key-value базу данных.
-
-// *
-// Cервер слушает запросы на указанном IP:PORT и предоставляет API для простой key-value базы данных.
-// Внутреннее хранилище сервера - boost::multi_index, который хранится в маппируемом в оперативную память файле.
-// Ключ имеет тип - Строка (максимальная длина 1024 символа).
-// Значение имеет тип - Строка (максимальная длина 1024 * 1024 символа).
-
-// База данных поддерживает операции:
-// *   INSERT - добавить key:value;
-// *   UPDATE - изменить key:value;
-// *   DELETE - удалить key;
-// *   GET    - получить value по key.
-
-// * Если ключ уже существует, то при операции INSERT База Данных возвращает ошибку, что запись отсутсвует.
-// * Если ключ не существует, то при операции UPDATE База Данных возвращает ошибку, что запись отсутсвует.
-// * Если ключ существует и значение совпадает, то при операции UPDATE База Данных возвращает ошибку, что значение не было изменено.
-// * Если ключ не существует, то при операции DELETE База Данных возвращает ошибку об отсутствующей записи.
-// * Если ключ не существует, то при операции GET База Данных возвращает ошибку об отсутствующей записи.
-
-// *
-// Клиент получает из коммандной строки:
-//   - адрес сервера;
-//   - команду;
-//   - ключ;
-//   - значение.
-
-// После выполнения команды клиент возвращает успешность выполнения и ошибку, если она возникла.
-
-// Сервер ведет статистику отправленных и полученных комманд.
-// С переодичности в 60 секунд, сервер выводит на std::cerr статистику:
-//    - количество записей в БД;
-//    - количество успешных/неуспешных операций INSERT;
-//    - количество успешных/неуспешных операций UPDATE;
-//    - количество успешных/неуспешных операций DELETE;
-//    - количество успешных/неуспешных операций GET.
-
-// * Общение по собственному протоколу поверх TCP/IP.
-//   Для автоматизации сериализации структур использовать boost::fusion.
-// * Для реализации сетевого взаимодействия использовать boost::asio. 
-//   Для реализации потоков использовать возможности boost::asio.
-// * Для реализации таймеров использовать возможности boost::asio.
-// * Для хранения данных использовать boost::multi_index и boost::interprocess. 
-
-// Сборка C++-проекта должна осуществляться с помощью CMake.
-// Для сборки сформировать Dokerfile на базе Ubuntu 20.08.
-
-// Результат прислать на почту hr@cyber-core.dev.
-
-#include <boost/thread.hpp>
-#include <boost/bind.hpp>
-#include <boost/asio.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/enable_shared_from_this.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
-#include <boost/scoped_ptr.hpp>
-#include <boost/chrono.hpp>
-#include <boost/regex.hpp>
-
-#include <boost/thread/thread.hpp>
-
-#include <boost/multi_array.hpp>
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/hashed_index.hpp>
-#include <boost/multi_index/key_extractors.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/member.hpp>
-
-#include <boost/archive/binary_oarchive.hpp>
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/serialization/set.hpp>
-
-#include <boost/interprocess/managed_shared_memory.hpp>
-#include <boost/interprocess/containers/string.hpp>
-
-#include <fstream>
-#include <iostream>
-#include <cstdlib> 
-#include <cstring>
-#include <ctime>
-#include <string>
-#include <stdio.h>
-
-#if !defined(WIN32) and !defined(WINDOWS)
-#   define sprintf_s  snprintf
-#endif
-
-//-----------------------------------------------------------------------------
-// Execute Around Pointer Idiom
-// Заимствованный шаблон
-//-----------------------------------------------------------------------------
-
-template<typename T, typename mutex_type = std::recursive_mutex>
-class SafeObj {
-    std::shared_ptr<mutex_type> mtx;
-    std::shared_ptr<T>          p;
-
-    void lock  () const { mtx->lock(); }
-    void unlock() const { mtx->unlock(); }
-
-public:
-    class proxy {
-        std::unique_lock< mutex_type > lock;
-        T* const p;
-    public:
-        proxy(T* const _p, mutex_type& _mtx) : lock(_mtx), p(_p) {}
-        proxy(proxy&& px) : lock(std::move(px.lock)), p(px.p) {}
-        ~proxy() {}
-        T* operator -> () {return p;}
-        const T* operator -> () const {return p;}
-    };
-
-    template< typename ...Args >
-    SafeObj(Args ... args) : mtx(std::make_shared< mutex_type >()), p(std::make_shared< T >(args...)) {}
-
-    proxy operator->() { return proxy(p.get(), *mtx); }
-    const proxy operator->() const { return proxy(p.get(), *mtx); }
-    template< class Args > friend class std::lock_guard;
-};
-
-using namespace ::boost::multi_index;
-using namespace ::boost::interprocess;
-
-//-----------------------------------------------------------------------------
-// Statistics
-//-----------------------------------------------------------------------------
-
-struct ServerStastistics {
-    unsigned int successInsert = 0;
-    unsigned int failInsert    = 0;
-    unsigned int successUpdate = 0;
-    unsigned int failUpdate    = 0;
-    unsigned int successDelete = 0;
-    unsigned int failDelete    = 0;
-    unsigned int successGet    = 0;
-    unsigned int failGet       = 0;
-};
-
-//-----------------------------------------------------------------------------
-// Storage for BD
-//-----------------------------------------------------------------------------
-
-struct StorageItem {
-    std::string m_key, m_val, addr;
-    struct IndByK {};
-    struct IndByV {};
-    struct ValChange : public std::unary_function<StorageItem, void> {
-        std::string p; ValChange(const std::string& _p) : p(_p) {}
-        void operator()(StorageItem& r) { r.m_val = p; }
-    };
-};
-
-typedef boost::multi_index_container<
-    StorageItem,
-    indexed_by<
-        ordered_unique<
-            tag<StorageItem::IndByK>, 
-            member<StorageItem, 
-            std::string, 
-            &StorageItem::m_key>
-        >,
-        ordered_non_unique<
-            tag<StorageItem::IndByV>, 
-            member<StorageItem, 
-            std::string, 
-            &StorageItem::m_val>
-        >
-    >
-> StorageContainer;
-
-typedef StorageContainer::index<StorageItem::IndByK>::type  StorageIndK;
-typedef StorageContainer::index<StorageItem::IndByV>::type  StorageIndV;
-typedef StorageIndK::const_iterator  StorageIteratorK;
-typedef StorageIndV::const_iterator  StorageIteratorV;
-
-struct shm_remove {
-    // Remove shared memory on construction and destruction
-    shm_remove () { shared_memory_object::remove("TCP_test_shared_memory"); }
-    ~shm_remove() { shared_memory_object::remove("TCP_test_shared_memory"); }
-} remover;
-
-class Storage {
-    std::string m_result    = "";
-    std::string m_file_path = "";
-    std::string m_command   = "";
-    std::string m_key       = "";
-    std::string m_val       = "";
-
-    managed_shared_memory* shm = nullptr;
-    StorageContainer*      container = nullptr;
-
-public:
-    ServerStastistics stat;
-
-public:
-    Storage () {
-        shm = new managed_shared_memory(create_only, "TCP_test_shared_memory", 1000);
-        container = shm->construct<StorageContainer>("StorageContainer")(); 
-    }
-
-    ~Storage() {
-        delete shm; shm = nullptr;
-    }
-
-    int execute(char* cmd, std::string* result)
-    {
-        m_result  = "";
-        m_command = "";
-        m_key     = "";
-        m_val     = "";
-
-        std::string s(cmd);
-        int i = s.find("\n");
-        m_command = s.substr(0, i);
-
-        if (i > 0) {
-            ++i;
-            int j = s.find("\n", i);
-            m_key = s.substr(i, (size_t)(j - i));
-
-            if (j > 0) {
-                ++j;
-                int k = s.find("\n", j);
-                m_val = s.substr(j, (size_t)(k - j));
-            }
-        }
-
-        return docommand(result) ? 1 : 0;
-    }
-
-    std::string get_result() 
-    {
-        return m_result;
-    } 
-
-    int load (const std::string& file_path)
-    {
-        if (file_path.length()) m_file_path = file_path;
-        if (!m_file_path.length()) return -1;
-
-        return 0;
-    }
-
-    int save(const std::string& file_path = "")
-    {
-        if (file_path.length()) m_file_path = file_path;
-        if (!m_file_path.length()) return -1;
-
-        if (container->size ()) {
-        }
-
-        return 0;
-    }
-
-private:
-    int docommand(std::string* result)
-    {
-        auto exit_error = [&] (int err_code, unsigned int& count) -> int {
-            m_result = "An entry with the \"" + m_key + "\" key is not found.";
-            if (result) *result = m_result;
-            ++count;
-            return err_code;
-        };
-
-        m_result = "";
-        const StorageIndK& ik  = container->get<StorageItem::IndByK>();
-        StorageIteratorK   itk = ik.find(m_key);
-        StorageItem        item;
-
-        if (m_command == "INSERT") {
-            if (itk != ik.end()) {
-                m_result = "An entry with the \"" + m_key + "\" key already exists.";
-                ++stat.failInsert;
-                if (result) *result = m_result;
-                return 1;
-            }
-            item.m_key = m_key;
-            item.m_val = m_val;
-            auto ok    = container->insert(item).second;
-            m_result   = std::string("Command INSERT is ") + (ok ? "successful" : "failed") + " execute.";
-            ++(ok ? stat.successInsert : stat.failInsert);
-        }
-        else if (m_command == "UPDATE") {
-            if (itk == ik.end()) return exit_error(2, stat.failUpdate);
-            StorageIteratorV itv = container->project<StorageItem::IndByV>(itk);
-            StorageIndV&     iv  = container->get<StorageItem::IndByV>();
-            auto ok  = iv.modify(itv, StorageItem::ValChange(m_val));
-            m_result = std::string("Command UPDATE is ") + (ok ? "successful" : "failed") + " execute.";
-            ++(ok ? stat.successUpdate : stat.failUpdate);
-        }
-        else if (m_command == "DELETE") {
-            if (itk == ik.end()) return exit_error(4, stat.failDelete);
-            auto r   = container->erase(itk);
-            auto key = r->m_key;
-            bool ok  = (key != m_key); 
-            m_result = std::string("Command DELETE is ") + (ok ? "successful" : "failed") + " execute.";
-            ++(ok ? stat.successDelete : stat.failDelete);
-        }
-        else if (m_command == "GET") {
-            if (itk == ik.end()) return exit_error(5, stat.failGet);
-            m_key    = (*itk).m_key;
-            m_val    = (*itk).m_val;
-            m_result = "Get is successful: key = \"" + m_key + "\" value = \"" + m_val + "\"";
-            ++stat.successGet;
-        }
-        if (result) *result = m_result;
-        return 0;
-    }
-}; 
-
-//-----------------------------------------------------------------------------
-// Global objects
-//-----------------------------------------------------------------------------
-
-using namespace boost::asio;
-
-typedef boost::asio::deadline_timer Timer;
-typedef boost::posix_time::seconds  Interval;
-typedef SafeObj<Storage>            SafeStorage;
-
-// Storage create like thread safe object.
-SafeStorage storage;
-
-// Timeout for show statistics.
-const int   time_interval = 60;
-Timer      *ptimer = nullptr;
-
-// Port number
-const int   server_port   = 31415;
-
-//-----------------------------------------------------------------------------
-// Thread body for show statistics time from time
-//-----------------------------------------------------------------------------
-
-void statistics_show_loop(const boost::system::error_code& /*e*/) 
-{
-    std::cerr << " ----------- Test server statistics------" << std::endl;
-    std::cerr << "           " << "Successfull"   "       Fail" << std::endl;
-    std::cerr << " ----------------------------------------" << std::endl;
-    std::cerr << " Insert:   " << std::setw(11) << storage->stat.successInsert << std::setw(11) << storage->stat.failInsert << std::endl;
-    std::cerr << " Update:   " << std::setw(11) << storage->stat.successUpdate << std::setw(11) << storage->stat.failUpdate << std::endl;
-    std::cerr << " Delete:   " << std::setw(11) << storage->stat.successDelete << std::setw(11) << storage->stat.failDelete << std::endl;
-    std::cerr << " Get   :   " << std::setw(11) << storage->stat.successGet    << std::setw(11) << storage->stat.failGet    << std::endl;
-    std::cerr << " ----------------------------------------" << std::endl << std::endl;
-
-    if (!ptimer) return;
-    ptimer->expires_at(ptimer->expires_at() + Interval(time_interval));
-    ptimer->async_wait(statistics_show_loop);
-}
-
-//-----------------------------------------------------------------------------
-// Implementation of Server.
-//-----------------------------------------------------------------------------
-
-std::ostream& operator << (std::ostream& stream, const boost::system::error_code& err)
-{
-    return stream
-        << err.category().name()
-        << " message: "
-        << err.message() << std::endl;
-}
-
-class Server :public boost::enable_shared_from_this<Server>
-{
-private:
-    io_service&      m_service;
-    static const int m_message_length = 3072;
-    char             m_read_buf[m_message_length];
-    ip::tcp::socket  m_socket;
-    boost::scoped_ptr<ip::tcp::acceptor> m_acc;
-
-public:
-    Server(io_service& service_) : 
-        m_service(service_),
-        m_socket(service_)
-    {
-    }
-
-    void start()
-    {
-        std::cout << "Server is started..." << std::endl;
-        accept();
-    }
-
-    void accept()
-    {
-        auto endpoint = ip::tcp::endpoint(ip::tcp::v4(), server_port);
-        auto acceptor = new ip::tcp::acceptor(m_service, endpoint);
-        m_acc.reset(acceptor);
-        auto hnd = boost::bind(&Server::on_accept, shared_from_this(), _1);
-        m_acc->async_accept(m_socket, hnd);
-    }
-
-    void on_accept(const boost::system::error_code& err)
-    {
-        if (err) {
-            std::cout << "Accept error: " << err << std::endl;
-            close();
-            return;
-        }
-        read();
-    }
-
-    void close()
-    {
-        std::cout << "Close server." << std::endl;
-        if (m_socket.is_open())        m_socket.close();
-        if (m_acc && m_acc->is_open()) m_acc->close();
-    }
-
-    void read()
-    {
-        auto buf = buffer(m_read_buf, m_message_length);
-        auto hnd = boost::bind(&Server::on_read, shared_from_this(), _1);
-        async_read(m_socket, buf, hnd);
-    }
-
-    void on_read(const boost::system::error_code& err)
-    {
-        if (err) {
-            // End of file. Client dropped connection.
-            if (err.value() == 2) {
-                // Close current socket
-                if (m_socket.is_open())        m_socket.close();
-                if (m_acc && m_acc->is_open()) m_acc->close();
-                // New accept
-                accept();
-                // Exit from current read.
-                return;
-            }
-            // Error reading from socket
-            std::cout << "Error in read: " << err;
-            // Close socket and close server.
-            close();
-            return;
-        }
-
-        std::string s(m_read_buf);
-        std::replace(s.begin(), s.end(), '\n', '\t');
-        std::cout << "Received from client: " << s << std::endl;
-
-        // Execute received command.
-        std::string result;
-        storage->execute(m_read_buf, &result);
-
-        // Answer to client. 
-        write_answer(result);
-    }
-
-    void write_answer(std::string result)
-    {
-        sprintf_s(m_read_buf, m_message_length, "%s", result.c_str());
-        auto buf = buffer(m_read_buf);
-        auto hnd = boost::bind(&Server::on_write_answer, shared_from_this(), _1, _2);
-        async_write(m_socket, buf, hnd);
-        std::cout << "Sent to client:       " << result << std::endl;
-    }
-
-    void on_write_answer(const boost::system::error_code& err, size_t bytes)
-    {
-        if (err) {
-            std::cout << "Error in write: " << err << std::endl;
-            close();
-            return;
-        }
-        // Begin new reading from socket
-        read();
-    }
-};
-
-//-----------------------------------------------------------------------------
-// Main program
-//-----------------------------------------------------------------------------
-
-int main(int argc, char* argv[])
-{
-/*
-    {
-        StorageContainer store;
-        StorageItem r1 = { "Basilio", "022" };
-        bool ok1 = store.insert(r1).second;
-        StorageItem r2 = { "Pupkinio", "022" };
-        bool ok2 = store.insert(r2).second;
-        StorageItem r3 = { "aaaa", "023" };
-        bool ok3 = store.insert(r3).second;
-        StorageItem r4 = { "sssss", "024" };
-        bool ok4 = store.insert(r4).second;
-
-        std::string find_id = "Pupkinio";
-        typedef StorageContainer::index<StorageItem::IndByK>::type NList;
-        typedef StorageContainer::index<StorageItem::IndByV>::type PList;
-        NList& ns = store.get<StorageItem::IndByK >();
-        PList& ps = store.get<StorageItem::IndByV>();
-        NList::const_iterator nit = ns.find(find_id);
-        if (nit != ns.end()) {
-            PList::const_iterator pit = store.project<StorageItem::IndByV>(nit);
-            ps.modify(pit, StorageItem::ValChange("134"));
-        }
-        nit = ns.find(find_id);
-        auto fine = (*nit).m_val;
-       std::cout << fine << std::endl;
-    }
-*/
-#if defined WIN32 or defined WINDOWS
-    SetConsoleCP(1251);
-    SetConsoleOutputCP(1251);
-#else
-    setlocale(LC_ALL, "Russian");
-#endif
-
-    std::string storage_file_path = "./test_storage";
-    if (storage->load(storage_file_path)) {
-        std::cout << "Error of open storage file. Server closing..." << std::endl;
-        return 1;
-    }
-
-    io_service serv_service;
-
-    Timer timer(serv_service, Interval(time_interval));    
-    timer.async_wait(statistics_show_loop);
-    ptimer = &timer;
-
-    boost::shared_ptr<Server> s = boost::make_shared<Server>(serv_service);
-    s->start();
-    serv_service.run();
-
-    std::cout << "Server closing..." << std::endl;
-    if (storage->save()) {
-        std::cout << "Error of save storage file." << std::endl;
-        return 1;
-    }
-}
+// testboost.cpp : Этот файл содержит функцию "main". Здесь начинается и заканчивается выполнение программы.
+//
+
+// Nikolenko.cpp
+
+// Реализовать небольшую key-value базу данных.
+
+// *
+// Cервер слушает запросы на указанном IP:PORT и предоставляет API для простой key-value базы данных.
+// Внутреннее хранилище сервера - boost::multi_index, который хранится в маппируемом в оперативную память файле.
+// Ключ имеет тип - Строка (максимальная длина 1024 символа).
+// Значение имеет тип - Строка (максимальная длина 1024 * 1024 символа).
+
+// База данных поддерживает операции:
+// *   INSERT - добавить key:value;
+// *   UPDATE - изменить key:value;
+// *   DELETE - удалить key;
+// *   GET    - получить value по key.
+
+// * Если ключ уже существует, то при операции INSERT База Данных возвращает ошибку, что запись отсутсвует.
+// * Если ключ не существует, то при операции UPDATE База Данных возвращает ошибку, что запись отсутсвует.
+// * Если ключ существует и значение совпадает, то при операции UPDATE База Данных возвращает ошибку, что значение не было изменено.
+// * Если ключ не существует, то при операции DELETE База Данных возвращает ошибку об отсутствующей записи.
+// * Если ключ не существует, то при операции GET База Данных возвращает ошибку об отсутствующей записи.
+
+// *
+// Клиент получает из коммандной строки:
+//   - адрес сервера;
+//   - команду;
+//   - ключ;
+//   - значение.
+
+// После выполнения команды клиент возвращает успешность выполнения и ошибку, если она возникла.
+
+// Сервер ведет статистику отправленных и полученных комманд.
+// С переодичности в 60 секунд, сервер выводит на std::cerr статистику:
+//    - количество записей в БД;
+//    - количество успешных/неуспешных операций INSERT;
+//    - количество успешных/неуспешных операций UPDATE;
+//    - количество успешных/неуспешных операций DELETE;
+//    - количество успешных/неуспешных операций GET.
+
+// * Общение по собственному протоколу поверх TCP/IP.
+//   Для автоматизации сериализации структур использовать boost::fusion.
+// * Для реализации сетевого взаимодействия использовать boost::asio. 
+//   Для реализации потоков использовать возможности boost::asio.
+// * Для реализации таймеров использовать возможности boost::asio.
+// * Для хранения данных использовать boost::multi_index и boost::interprocess. 
+
+// Сборка C++-проекта должна осуществляться с помощью CMake.
+// Для сборки сформировать Dokerfile на базе Ubuntu 20.08.
+
+// Результат прислать на почту hr@cyber-core.dev.
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/chrono.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include <boost/thread/thread.hpp>
+
+#include "Protocol.h"
+#include "Storage.h"
+#include "Replica.h"
+#include "HandlerMemory.h"
+#include "Log.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdlib> 
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <stdio.h>
+
+#if !defined(WIN32) and !defined(WINDOWS)
+#   define sprintf_s  snprintf
+#endif
+
+//-----------------------------------------------------------------------------
+// Global objects
+//-----------------------------------------------------------------------------
+
+using namespace boost::asio;
+
+typedef boost::asio::deadline_timer Timer;
+typedef boost::posix_time::seconds  Interval;
+
+// Storage is created in main, when the number of shards is known.
+// It is thread safe itself.
+boost::scoped_ptr<Storage> storage;
+
+// Timeout for show statistics.
+const int   time_interval = 60;
+Timer      *ptimer = nullptr;
+
+// Expired items are deleted in background once a second.
+const int   expire_interval = 1;
+Timer      *pexpire_timer = nullptr;
+
+// Port number by default
+const int   server_port   = 31415;
+
+//-----------------------------------------------------------------------------
+// Command line options of server
+//-----------------------------------------------------------------------------
+
+struct ServerOptions {
+    // Port of clients.
+    unsigned int port    = server_port;
+    // Number of threads running io_service.
+    unsigned int threads = 1;
+    // Number of independently locked partitions of storage.
+    unsigned int shards  = 16;
+    // Memory-mapped file of storage.
+    std::string  storage_file_path = "./test_storage";
+    // Write-ahead log of storage.
+    JournalOptions journal;
+    // Memory of items, cold ones are evicted above it. 0 - no limit.
+    std::size_t  memory_limit = 0;
+    // Values of this size and longer are kept compressed. 0 - never.
+    unsigned int compress_min = 512;
+    // Seconds of connection without requests before it is closed, 0 - never.
+    unsigned int idle_timeout    = 300;
+    // Seconds to send the rest of frame or to read answers, 0 - no limit.
+    unsigned int request_timeout = 30;
+    // Connections of clients at once, the next ones are busy. 0 - no limit.
+    unsigned int max_connections = 1024;
+    // Port of HTTP endpoint with statistics on localhost, 0 - off.
+    unsigned int metrics_port = 0;
+    // Records of log below this level are skipped, requests are of Debug.
+    LogLevel     log_level = LogLevel::Info;
+    // Records of requests per second, 0 - all of them.
+    unsigned int log_rate  = 0;
+    // Address and port of primary server for replica, empty for primary.
+    std::string  primary_host;
+    std::string  primary_port;
+};
+
+ServerOptions options;
+
+bool test_command_string(int argc, char* argv[], ServerOptions& opt)
+{
+    auto get_number = [&](int& i, unsigned int& value) -> bool {
+        if (++i >= argc) return false;
+        char* end = nullptr;
+        unsigned long n = strtoul(argv[i], &end, 10);
+        if (end == argv[i] || *end) return false;
+        value = (unsigned int)n;
+        return true;
+    };
+    auto get_string = [&](int& i, std::string& value) -> bool {
+        if (++i >= argc) return false;
+        value = argv[i];
+        return value.length() > 0;
+    };
+
+    int i = 1;
+    while (i < argc) {
+        std::string arg = argv[i];
+        if (arg == "-p" || arg == "--port") {
+            if (!get_number(i, opt.port) || !opt.port || opt.port > 65535) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--replica-of") {
+            std::string address;
+            if (!get_string(i, address)) return false;
+            auto colon = address.rfind(':');
+            opt.primary_host = address.substr(0, colon);
+            opt.primary_port = colon == std::string::npos ? std::to_string(server_port) : address.substr(colon + 1);
+            if (opt.primary_host.empty() || opt.primary_port.empty()) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "-t" || arg == "--threads") {
+            if (!get_number(i, opt.threads) || !opt.threads) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "-s" || arg == "--shards") {
+            if (!get_number(i, opt.shards) || !opt.shards) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "-f" || arg == "--file") {
+            if (!get_string(i, opt.storage_file_path)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "-w" || arg == "--wal") {
+            std::string sync;
+            if (!get_string(i, sync) || !journal_sync_by_name(sync, opt.journal.sync)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--wal-interval") {
+            if (!get_number(i, opt.journal.interval_ms) || !opt.journal.interval_ms) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--compress") {
+            if (!get_number(i, opt.compress_min)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--idle-timeout") {
+            if (!get_number(i, opt.idle_timeout)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--request-timeout") {
+            if (!get_number(i, opt.request_timeout)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--max-connections") {
+            if (!get_number(i, opt.max_connections)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "-m" || arg == "--metrics-port") {
+            if (!get_number(i, opt.metrics_port) || opt.metrics_port > 65535) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "-l" || arg == "--log-level") {
+            std::string level;
+            if (!get_string(i, level) || !log_level_by_name(level, opt.log_level)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--log-rate") {
+            if (!get_number(i, opt.log_rate)) return false;
+            ++i;
+            continue;
+        }
+        if (arg == "--snapshot-size") {
+            unsigned int mb = 0;
+            if (!get_number(i, mb)) return false;
+            opt.journal.snapshot_size = (std::size_t)mb * 1024 * 1024;
+            ++i;
+            continue;
+        }
+        if (arg == "--memory-limit") {
+            unsigned int mb = 0;
+            if (!get_number(i, mb)) return false;
+            opt.memory_limit = (std::size_t)mb * 1024 * 1024;
+            ++i;
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Thread body for show statistics time from time
+//-----------------------------------------------------------------------------
+
+void statistics_show_loop(const boost::system::error_code& /*e*/) 
+{
+    std::cerr << " ----------- Test server statistics------" << std::endl;
+    std::cerr << "           " << "Successfull"   "       Fail" << std::endl;
+    std::cerr << " ----------------------------------------" << std::endl;
+    std::cerr << " Insert:   " << std::setw(11) << storage->stat.successInsert << std::setw(11) << storage->stat.failInsert << std::endl;
+    std::cerr << " Update:   " << std::setw(11) << storage->stat.successUpdate << std::setw(11) << storage->stat.failUpdate << std::endl;
+    std::cerr << " Delete:   " << std::setw(11) << storage->stat.successDelete << std::setw(11) << storage->stat.failDelete << std::endl;
+    std::cerr << " Get   :   " << std::setw(11) << storage->stat.successGet    << std::setw(11) << storage->stat.failGet    << std::endl;
+    std::cerr << " Cas   :   " << std::setw(11) << storage->stat.successCas    << std::setw(11) << storage->stat.failCas    << std::endl;
+    std::cerr << " CDelete:  " << std::setw(11) << storage->stat.successCDelete << std::setw(11) << storage->stat.failCDelete << std::endl;
+    std::cerr << " Expire:   " << std::setw(11) << storage->stat.successExpire << std::setw(11) << storage->stat.failExpire << std::endl;
+    std::cerr << " ----------------------------------------" << std::endl;
+    std::cerr << " Latency, us:   p50        p99       p999" << std::endl;
+    for (std::uint8_t op = protocol::OpInsert; op <= protocol::OpGet; ++op) {
+        auto& h = storage->stat.latency[op];
+        std::cerr << " " << std::setw(6) << std::left << protocol::opcode_name(op) << std::right << ":"
+                  << std::setw(11) << h.percentile(0.5)   / 1000.0
+                  << std::setw(11) << h.percentile(0.99)  / 1000.0
+                  << std::setw(11) << h.percentile(0.999) / 1000.0 << std::endl;
+    }
+    std::cerr << " ----------------------------------------" << std::endl;
+    std::cerr << " Entries:      " << storage->stat.entries << std::endl;
+    std::cerr << " Expired:      " << storage->stat.expired << std::endl;
+    if (storage->memory_limit()) {
+        std::cerr << " Evicted:      " << storage->stat.evicted << std::endl;
+        std::cerr << " Memory:       " << storage->items_memory() << " of " << storage->memory_limit() << " bytes" << std::endl;
+    }
+    if (storage->compress_min()) {
+        std::cerr << " Compressed:   " << storage->stat.compressed 
+                  << " (sent compressed " << storage->stat.compressedSent << ")" << std::endl;
+    }
+    std::cerr << " Connections:  " << storage->stat.connections 
+              << " (accepted " << storage->stat.accepted << ", refused " << storage->stat.refused 
+              << ", timed out " << storage->stat.timedOut << ")" << std::endl;
+    if (storage->stat.replicas) 
+        std::cerr << " Replicas:     " << storage->stat.replicas << std::endl;
+    if (options.primary_host.size()) {
+        std::cerr << " Replication:  " << (storage->stat.replicaSynced ? "synced" : "not synced")
+                  << ", LSN " << storage->stat.replicaLsn << ", lag " << storage->stat.replicaLag << " records, "
+                  << storage->stat.replicaLagMs / 1000.0 << " s" << std::endl;
+    }
+    std::cerr << " Received:     " << storage->stat.bytesIn  << " bytes" << std::endl;
+    std::cerr << " Sent:         " << storage->stat.bytesOut << " bytes" << std::endl;
+    std::cerr << " ----------------------------------------" << std::endl << std::endl;
+
+    if (!ptimer) return;
+    ptimer->expires_at(ptimer->expires_at() + Interval(time_interval));
+    ptimer->async_wait(statistics_show_loop);
+}
+
+//-----------------------------------------------------------------------------
+// Deletion of expired items by small steps
+//-----------------------------------------------------------------------------
+
+void expire_loop(const boost::system::error_code& e)
+{
+    if (e || !pexpire_timer) return;
+    // Work is left: the next step goes after handlers waiting meanwhile.
+    bool more = storage->expire_step();
+    pexpire_timer->expires_from_now(more ? boost::posix_time::time_duration() : Interval(expire_interval));
+    pexpire_timer->async_wait(expire_loop);
+}
+
+//-----------------------------------------------------------------------------
+// Network helpers
+//-----------------------------------------------------------------------------
+
+std::ostream& operator << (std::ostream& stream, const boost::system::error_code& err)
+{
+    return stream
+        << err.category().name()
+        << " message: "
+        << err.message() << std::endl;
+}
+
+//-----------------------------------------------------------------------------
+// Session - one client connection. 
+// Owns its own socket and buffer. All its work is one loop, a stackless 
+// coroutine: read requests, execute complete frames, write their answers.
+// The loop holds the session while it runs, so its handlers keep a plain
+// pointer, and their memory is the memory of session: a request costs no
+// allocation and no copy of shared pointer.
+// Nothing is read while answers are written, and one pass over input makes
+// at most m_max_output of them: client which does not read its answers is
+// not read either. Every operation of loop has a deadline, the watchdog of
+// session closes the socket when it is over.
+//-----------------------------------------------------------------------------
+
+#include <boost/asio/yield.hpp>
+
+class Session : public boost::enable_shared_from_this<Session>
+{
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Minimal free space of input buffer for one read.
+    static const std::size_t m_read_chunk = 16 * 1024;
+    // Answers made before they are written, frames after them wait.
+    static const std::size_t m_max_output = 1024 * 1024;
+
+    ip::tcp::socket  m_socket;
+    // All handlers of one session are serialized, even when
+    // io_service is run by the pool of threads.
+    io_service::strand m_strand;
+
+    // Requests: client may send many frames back-to-back, everything 
+    // received is kept here until it is parsed into complete frames.
+    std::vector<char>       m_input;
+    std::size_t             m_input_size = 0;
+
+    // Answers to all frames of one read are formatted here one after 
+    // another and sent by one write. Value of GET is copied from storage 
+    // right to its place after the header.
+    std::string             m_output;
+    bool                    m_close_after_write = false;
+    // Items of the current batch command.
+    std::vector<protocol::BatchItem> m_items;
+    // Scan being answered: one chunk of about m_scan_chunk bytes per write.
+    static const std::size_t m_scan_chunk = 64 * 1024;
+    StorageScan             m_scan;
+    bool                    m_scanning = false;
+    // Replica fed after SYNC: copy of storage by chunks, then records of
+    // journal as they are written. Session reads nothing more then.
+    static const std::size_t m_max_feed = 64 * 1024 * 1024;
+    bool                    m_syncing   = false;
+    bool                    m_sync_idle = false;     // Waits for records
+    StorageCopy             m_copy;
+    std::uint64_t           m_sync_lsn  = 0;
+    std::uint64_t           m_feed_id   = 0;
+    std::string             m_feed;                  // Records not sent yet
+    Timer                   m_heartbeat;
+    // Journal record of the last change made by answers, 0 if none.
+    std::uint64_t             m_answers_lsn = 0;
+    bool                      m_durable     = true;
+    // Session is counted in statistics since start.
+    bool                      m_started = false;
+    // Loop of session and memory of its handlers: one operation of loop
+    // is in flight at a time.
+    boost::asio::coroutine     m_loop;
+    HandlerMemory              m_memory;
+    boost::shared_ptr<Session> m_self;      // While the loop runs
+    // Deadline of the current operation of loop, the max one - no deadline.
+    // Incomplete frame must be received before its own deadline.
+    boost::asio::steady_timer  m_watchdog;
+    HandlerMemory              m_watch_memory;
+    Clock::time_point          m_deadline = Clock::time_point::max();
+    Clock::time_point          m_frame_deadline;
+
+    // Handler of every operation of loop: resumes it in the strand.
+    struct Step {
+        Session* self;
+
+        typedef io_service::strand     executor_type;
+        typedef HandlerAllocator<Step> allocator_type;
+
+        executor_type  get_executor()  const noexcept { return self->m_strand; }
+        allocator_type get_allocator() const noexcept { return allocator_type(self->m_memory); }
+
+        void operator()(const boost::system::error_code& err = boost::system::error_code(), size_t bytes = 0) const
+        {
+            self->resume(err, bytes);
+        }
+    };
+
+    // Handler of watchdog, it holds the session until it is called.
+    struct Watch {
+        boost::shared_ptr<Session> self;
+
+        typedef io_service::strand      executor_type;
+        typedef HandlerAllocator<Watch> allocator_type;
+
+        executor_type  get_executor()  const noexcept { return self->m_strand; }
+        allocator_type get_allocator() const noexcept { return allocator_type(self->m_watch_memory); }
+
+        void operator()(const boost::system::error_code& err) const { self->on_watchdog(err); }
+    };
+
+    // Journal calls it by its thread when answers are durable, or are not
+    // because the journal is failed.
+    struct Durable {
+        Session* self;
+        void operator()(bool durable) const 
+        { 
+            self->m_durable = durable;
+            self->m_strand.post(Step{ self }); 
+        }
+    };
+
+public:
+    Session(io_service& service_) : 
+        m_socket(service_),
+        m_strand(service_),
+        m_input(m_read_chunk),
+        m_heartbeat(service_),
+        m_watchdog(service_)
+    {
+    }
+
+    ~Session()
+    {
+        if (m_started) --storage->stat.connections;
+    }
+
+    ip::tcp::socket& socket() { return m_socket; }
+
+    void start()
+    {
+        m_started = true;
+        ++storage->stat.connections;
+        ++storage->stat.accepted;
+        m_self = shared_from_this();
+        if (watch_period().count()) watch(Clock::now());
+        resume();
+    }
+
+    // Client over the limit of connections gets StatusBusy and is dropped
+    // at once. It is not counted as connection and has no loop.
+    void refuse()
+    {
+        ++storage->stat.refused;
+        logger().write(LogLevel::Debug, "Too many connections, client is refused.");
+        add_answer(protocol::StatusBusy);
+        auto self = shared_from_this();
+        async_write(m_socket, buffer(m_output), [self](const boost::system::error_code&, size_t) { self->close(); });
+    }
+
+    void close()
+    {
+        stop_sync();
+        boost::system::error_code err;
+        if (m_socket.is_open()) m_socket.close(err);
+    }
+
+private:
+    // Session is freed when its loop is over and nothing else holds it.
+    void resume(const boost::system::error_code& err = boost::system::error_code(), size_t bytes = 0)
+    {
+        loop(err, bytes);
+        if (!m_loop.is_complete()) return;
+        boost::system::error_code ignored;
+        m_watchdog.cancel(ignored);
+        boost::shared_ptr<Session> self;
+        self.swap(m_self);
+    }
+
+    void loop(const boost::system::error_code& err, size_t bytes)
+    {
+        reenter (m_loop) {
+            while (m_socket.is_open()) {
+                // Idle client between requests, or the rest of frame.
+                m_deadline = m_input_size ? m_frame_deadline : deadline(options.idle_timeout);
+                yield m_socket.async_read_some(read_buffer(), Step{ this });
+                if (err) {
+                    // End of file. Client dropped connection, or watchdog closed it.
+                    if (err != error::eof && err != error::operation_aborted) 
+                        logger().write(LogLevel::Error, "Error in read: %s", err.message().c_str());
+                    close();
+                    break;
+                }
+                if (!m_input_size) m_frame_deadline = deadline(options.request_timeout);
+                m_input_size += bytes;
+                storage->stat.bytesIn += bytes;
+                process();
+
+                // Every write sends everything made meanwhile: answers to
+                // frames, the next chunk of scan or the next frame of SYNC.
+                while (!m_output.empty()) {
+                    // Changes must be on disk before client is told about them.
+                    if (waits_durable()) {
+                        m_deadline = Clock::time_point::max();
+                        yield storage->journal()->wait_durable(m_answers_lsn, Durable{ this });
+                        if (!m_durable) fail_answers();
+                    }
+                    m_deadline = deadline(options.request_timeout);
+                    yield async_write(m_socket, buffer(m_output), Step{ this });
+                    written(bytes);
+                    if (err) {
+                        if (err != error::operation_aborted) 
+                            logger().write(LogLevel::Error, "Error in write: %s", err.message().c_str());
+                        close();
+                        break;
+                    }
+                    if (m_close_after_write) {
+                        close();
+                        break;
+                    }
+                    if (m_syncing) {
+                        if (sync_next()) continue;
+                        // Records of journal cancel the wait of heartbeat.
+                        m_deadline = Clock::time_point::max();
+                        yield wait_feed();
+                        m_sync_idle = false;
+                        if (!m_syncing) break;
+                        // Replica learns that primary is alive and its last LSN.
+                        if (!sync_next()) end_answer(begin_answer(), protocol::StatusOk, protocol::ResponseMore, 
+                                                     storage->journal()->last_lsn());
+                    }
+                    else if (m_scanning) {
+                        scan_next();
+                    }
+                    else {
+                        // Frames received before.
+                        process();
+                    }
+                }
+            }
+        }
+    }
+
+    // Free space of input for the next read.
+    mutable_buffer read_buffer()
+    {
+        // Give back memory of large frame once it is processed.
+        if (!m_input_size && m_input.size() > 4 * m_read_chunk) {
+            m_input.resize(m_read_chunk);
+            m_input.shrink_to_fit();
+        }
+        if (m_input.size() - m_input_size < m_read_chunk) 
+            m_input.resize(m_input_size + m_read_chunk);
+        return buffer(m_input.data() + m_input_size, m_input.size() - m_input_size);
+    }
+
+    // Execute complete frames of input, their answers are appended to
+    // output. Scan and SYNC answer by chunks: frames after them wait.
+    void process()
+    {
+        std::size_t pos = 0;
+        while (m_input_size - pos >= protocol::request_header_size) {
+            protocol::RequestHeader h;
+            protocol::decode(h, m_input.data() + pos);
+            if (!protocol::valid_request(h)) {
+                // Payload length can not be trusted, so the stream can not 
+                // be resynchronized: answer and drop the connection.
+                logger().write(LogLevel::Warning, "Invalid request header from client.");
+                m_close_after_write = true;
+                add_answer(protocol::StatusBadRequest);
+                break;
+            }
+            std::size_t frame_size = protocol::request_header_size + protocol::payload_length(h);
+            if (m_input_size - pos < frame_size) {
+                // Incomplete frame: make room for the rest of it.
+                if (m_input.size() - pos < frame_size) m_input.resize(pos + frame_size);
+                break;
+            }
+            execute(h, m_input.data() + pos + protocol::request_header_size);
+            pos += frame_size;
+            if (m_scanning || m_syncing || m_output.size() >= m_max_output) break;
+        }
+
+        // Keep the tail of incomplete frame at the beginning of buffer,
+        // its time goes from now.
+        if (pos) {
+            m_frame_deadline = deadline(options.request_timeout);
+            std::memmove(m_input.data(), m_input.data() + pos, m_input_size - pos);
+            m_input_size -= pos;
+        }
+    }
+
+    // Deadline in seconds from now, 0 - none.
+    static Clock::time_point deadline(unsigned int seconds)
+    {
+        return seconds ? Clock::now() + std::chrono::seconds(seconds) : Clock::time_point::max();
+    }
+
+    // Watchdog wakes up at the deadline, and at least once in the shortest
+    // timeout: deadline set meanwhile is never checked late.
+    static std::chrono::seconds watch_period()
+    {
+        unsigned int idle = options.idle_timeout, request = options.request_timeout;
+        return std::chrono::seconds(!idle ? request : !request ? idle : std::min(idle, request));
+    }
+
+    void watch(Clock::time_point now)
+    {
+        m_watchdog.expires_at(std::min(m_deadline, now + watch_period()));
+        m_watchdog.async_wait(Watch{ shared_from_this() });
+    }
+
+    void on_watchdog(const boost::system::error_code& err)
+    {
+        if (err || !m_socket.is_open()) return;
+        auto now = Clock::now();
+        if (now < m_deadline) return watch(now);
+        ++storage->stat.timedOut;
+        if (!m_input_size && m_output.empty()) 
+            logger().write(LogLevel::Debug, "Client is idle, connection is closed.");
+        else 
+            logger().write(LogLevel::Warning, "Client is too slow, connection is closed.");
+        // Operation of loop is aborted, the loop ends.
+        close();
+    }
+
+    bool waits_durable()
+    {
+        Journal* journal = storage->journal();
+        return m_answers_lsn && journal && journal->waits_for_sync();
+    }
+
+    // Changes of answers may be lost: every answer is replaced by
+    // StatusFailed, and connection is closed after them.
+    void fail_answers()
+    {
+        std::string output;
+        output.swap(m_output);
+        std::size_t pos = 0;
+        while (output.size() - pos >= protocol::response_header_size) {
+            protocol::ResponseHeader h;
+            protocol::decode(h, &output[pos]);
+            pos += protocol::response_header_size + h.length;
+            add_answer(protocol::StatusFailed);
+        }
+        m_scanning          = false;
+        m_close_after_write = true;
+    }
+
+    // Output is written: memory of large answer is given back, otherwise 
+    // it is kept for the next ones.
+    void written(size_t bytes)
+    {
+        m_output.clear();
+        if (m_output.capacity() > 4 * m_read_chunk) m_output.shrink_to_fit();
+        m_answers_lsn = 0;
+        storage->stat.bytesOut += bytes;
+    }
+
+    // Key and value are slices of the input buffer, they are not copied.
+    // Items of batch commands are slices too.
+    void execute(const protocol::RequestHeader& h, const char* payload)
+    {
+        bool batch = protocol::is_batch(h.opcode);
+        boost::string_view key(payload, batch ? 0 : h.key_length);
+        boost::string_view val(payload + key.size(), h.value_length);
+
+        std::size_t   pos     = begin_answer();
+        std::uint64_t lsn     = 0;
+        std::uint64_t version = 0;
+        std::uint8_t  flags   = 0;
+        auto          start = std::chrono::steady_clock::now();
+        int status = protocol::StatusOk;
+        if (h.opcode == protocol::OpStats) m_output += metrics_text(storage->stat);
+        else if (h.opcode == protocol::OpSync) status = start_sync(flags, version);
+        else if (options.primary_host.size() && protocol::is_change(h.opcode)) status = protocol::StatusReadOnly;
+        else if (protocol::is_scan(h.opcode)) status = start_scan(h.opcode, key, val, flags);
+        else if (!batch) status = storage->execute(h.opcode, key, val, &m_output, &lsn, &version, h.flags, &flags);
+        else if (!protocol::decode_batch(h, payload, m_items)) status = protocol::StatusBadRequest;
+        else status = storage->execute_batch(h.opcode, m_items, &m_output, &lsn);
+        storage->stat.latency[h.opcode].record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+        m_answers_lsn = std::max(m_answers_lsn, lsn);
+        end_answer(pos, status, flags, version);
+
+        if (logger().enabled(LogLevel::Debug) && logger().sample()) {
+            if (batch) key = "(batch)";
+            logger().write(LogLevel::Debug, "%s %.*s (%zu bytes): %s (%zu bytes)",
+                protocol::opcode_name(h.opcode), (int)std::min<std::size_t>(key.size(), 64), key.data(), 
+                val.size(), protocol::status_name(status), m_output.size() - pos - protocol::response_header_size);
+        }
+    }
+
+    // First chunk of answer of SCAN or PREFIX, the next ones are made
+    // when the previous one is written.
+    int start_scan(std::uint8_t opcode, boost::string_view key, boost::string_view val, std::uint8_t& flags)
+    {
+        protocol::ScanParams params;
+        protocol::decode(params, val.data());
+        boost::string_view cursor = val.substr(protocol::scan_params_size);
+        m_scan.reset(key, opcode == protocol::OpPrefix ? key : boost::string_view(), cursor, params.limit);
+        return scan_chunk(flags);
+    }
+
+    int scan_chunk(std::uint8_t& flags)
+    {
+        int status = storage->scan_chunk(m_scan, &m_output, m_scan_chunk);
+        m_scanning = status == protocol::StatusOk && !m_scan.done;
+        flags = m_scanning ? protocol::ResponseMore : m_scan.truncated ? protocol::ResponseTruncated : 0;
+        return status;
+    }
+
+    // First frame of answer to SYNC: the feed of journal is subscribed
+    // before the copy, so no change is lost. Version of frame is the LSN
+    // after which the records go.
+    int start_sync(std::uint8_t& flags, std::uint64_t& version)
+    {
+        Journal* journal = storage->journal();
+        if (!journal || options.primary_host.size()) return protocol::StatusFailed;
+        auto self = shared_from_this();
+        m_feed_id = journal->subscribe([self](const Journal::Records& records) {
+            self->m_strand.post(boost::bind(&Session::on_feed, self, records));
+        }, &m_sync_lsn);
+        m_syncing = true;
+        ++storage->stat.replicas;
+        logger().write(LogLevel::Info, "Replica is connected, changes after LSN %llu follow the copy.", 
+                       (unsigned long long)m_sync_lsn);
+
+        storage->copy_chunk(m_copy, &m_output, m_scan_chunk);
+        flags   = protocol::ResponseMore | (m_copy.done ? protocol::ResponseSynced : 0);
+        version = m_sync_lsn;
+        return protocol::StatusOk;
+    }
+
+    // Next frame of SYNC when the previous one is written: chunk of copy or
+    // records of journal. False when there is nothing to send until records
+    // or heartbeat come.
+    bool sync_next()
+    {
+        if (!m_copy.done) {
+            std::size_t pos = begin_answer();
+            storage->copy_chunk(m_copy, &m_output, m_scan_chunk);
+            std::uint8_t flags = protocol::ResponseMore | (m_copy.done ? protocol::ResponseSynced : 0);
+            end_answer(pos, protocol::StatusOk, flags, m_sync_lsn);
+            return true;
+        }
+        if (m_feed.empty()) return false;
+        std::size_t pos = begin_answer();
+        m_output += m_feed;
+        m_feed.clear();
+        if (m_feed.capacity() > 4 * m_read_chunk) m_feed.shrink_to_fit();
+        end_answer(pos, protocol::StatusOk, protocol::ResponseMore, storage->journal()->last_lsn());
+        return true;
+    }
+
+    void wait_feed()
+    {
+        m_sync_idle = true;
+        m_heartbeat.expires_from_now(Interval(1));
+        m_heartbeat.async_wait(Step{ this });
+    }
+
+    void on_feed(const Journal::Records& records)
+    {
+        if (!m_syncing) return;
+        if (m_feed.size() + records->size() > m_max_feed) {
+            logger().write(LogLevel::Warning, "Replica is too slow, it is disconnected.");
+            close();
+            return;
+        }
+        m_feed += *records;
+        if (!m_sync_idle) return;
+        boost::system::error_code err;
+        m_heartbeat.cancel(err);
+    }
+
+    void stop_sync()
+    {
+        if (!m_syncing) return;
+        m_syncing   = false;
+        m_sync_idle = false;
+        storage->journal()->unsubscribe(m_feed_id);
+        --storage->stat.replicas;
+        boost::system::error_code err;
+        m_heartbeat.cancel(err);
+        logger().write(LogLevel::Info, "Replica is disconnected.");
+    }
+
+    // Reserve room for header of answer, return its position in output.
+    std::size_t begin_answer()
+    {
+        std::size_t pos = m_output.size();
+        m_output.resize(pos + protocol::response_header_size);
+        return pos;
+    }
+
+    // Fill header of answer, its payload is everything appended after it.
+    void end_answer(std::size_t pos, int status, std::uint8_t flags = 0, std::uint64_t version = 0)
+    {
+        protocol::ResponseHeader h;
+        h.status  = (std::uint8_t)status;
+        h.flags   = flags;
+        h.version = version;
+        h.length  = (std::uint32_t)(m_output.size() - pos - protocol::response_header_size);
+        protocol::encode(h, &m_output[pos]);
+    }
+
+    void add_answer(int status)
+    {
+        end_answer(begin_answer(), status);
+    }
+
+    // Next chunk of scan when the previous one is written.
+    void scan_next()
+    {
+        std::uint8_t flags = 0;
+        std::size_t  pos   = begin_answer();
+        int status = scan_chunk(flags);
+        end_answer(pos, status, flags);
+    }
+};
+
+#include <boost/asio/unyield.hpp>
+
+//-----------------------------------------------------------------------------
+// Implementation of Server.
+// Long-lived acceptor, every accepted connection gets its own Session.
+//-----------------------------------------------------------------------------
+
+class Server :public boost::enable_shared_from_this<Server>
+{
+private:
+    io_service&        m_service;
+    ip::tcp::acceptor  m_acc;
+    // Acceptor is used by accept handlers and close() of signal handler.
+    io_service::strand m_strand;
+
+public:
+    Server(io_service& service_) : 
+        m_service(service_),
+        m_acc(service_),
+        m_strand(service_)
+    {
+    }
+
+    void start()
+    {
+        auto endpoint = ip::tcp::endpoint(ip::tcp::v4(), (unsigned short)options.port);
+        m_acc.open(endpoint.protocol());
+        m_acc.set_option(ip::tcp::acceptor::reuse_address(true));
+        m_acc.bind(endpoint);
+        m_acc.listen(socket_base::max_listen_connections);
+        logger().write(LogLevel::Info, "Server is started...");
+        accept();
+    }
+
+    void accept()
+    {
+        auto session = boost::make_shared<Session>(m_service);
+        auto hnd     = boost::bind(&Server::on_accept, shared_from_this(), session, _1);
+        m_acc.async_accept(session->socket(), m_strand.wrap(hnd));
+    }
+
+    void on_accept(boost::shared_ptr<Session> session, const boost::system::error_code& err)
+    {
+        if (err == error::operation_aborted) return;
+        if (err) logger().write(LogLevel::Error, "Accept error: %s", err.message().c_str());
+        else if (options.max_connections && storage->stat.connections >= options.max_connections) session->refuse();
+        else session->start();
+        // Wait for the next client at once, until close().
+        if (m_acc.is_open()) accept();
+    }
+
+    // Stop accepting clients, then stop io_service: workers leave run()
+    // and storage is saved by main.
+    void close()
+    {
+        auto self = shared_from_this();
+        m_strand.dispatch([self] {
+            logger().write(LogLevel::Info, "Close server.");
+            boost::system::error_code err;
+            if (self->m_acc.is_open()) self->m_acc.close(err);
+            self->m_service.stop();
+        });
+    }
+};
+
+//-----------------------------------------------------------------------------
+// Metrics endpoint.
+// Answers any HTTP request by the text of statistics, so it may be scraped
+// by Prometheus or read by curl. It listens on localhost only.
+//-----------------------------------------------------------------------------
+
+class MetricsConnection : public boost::enable_shared_from_this<MetricsConnection>
+{
+private:
+    // Request is read up to the empty line, longer ones are dropped.
+    static const std::size_t m_max_request = 8 * 1024;
+
+    ip::tcp::socket  m_socket;
+    streambuf        m_request;
+    std::string      m_answer;
+
+public:
+    MetricsConnection(io_service& service_) : 
+        m_socket(service_),
+        m_request(m_max_request)
+    {
+    }
+
+    ip::tcp::socket& socket() { return m_socket; }
+
+    void start()
+    {
+        auto hnd = boost::bind(&MetricsConnection::on_read, shared_from_this(), _1);
+        async_read_until(m_socket, m_request, "\r\n\r\n", hnd);
+    }
+
+    void on_read(const boost::system::error_code& err)
+    {
+        if (err) return;
+        std::string body = metrics_text(storage->stat);
+        m_answer = "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: " + std::to_string(body.length()) + "\r\n"
+                   "Connection: close\r\n\r\n" + body;
+        auto hnd = boost::bind(&MetricsConnection::on_write, shared_from_this(), _1);
+        async_write(m_socket, buffer(m_answer), hnd);
+    }
+
+    void on_write(const boost::system::error_code& /*err*/)
+    {
+        boost::system::error_code err;
+        m_socket.shutdown(ip::tcp::socket::shutdown_both, err);
+        m_socket.close(err);
+    }
+};
+
+class MetricsServer : public boost::enable_shared_from_this<MetricsServer>
+{
+private:
+    io_service&        m_service;
+    ip::tcp::acceptor  m_acc;
+
+public:
+    MetricsServer(io_service& service_) : 
+        m_service(service_),
+        m_acc(service_)
+    {
+    }
+
+    void start(unsigned short port)
+    {
+        auto endpoint = ip::tcp::endpoint(ip::address_v4::loopback(), port);
+        m_acc.open(endpoint.protocol());
+        m_acc.set_option(ip::tcp::acceptor::reuse_address(true));
+        m_acc.bind(endpoint);
+        m_acc.listen();
+        logger().write(LogLevel::Info, "Metrics are served on http://%s:%u/metrics", 
+                       endpoint.address().to_string().c_str(), (unsigned)endpoint.port());
+        accept();
+    }
+
+    void accept()
+    {
+        auto connection = boost::make_shared<MetricsConnection>(m_service);
+        auto hnd        = boost::bind(&MetricsServer::on_accept, shared_from_this(), connection, _1);
+        m_acc.async_accept(connection->socket(), hnd);
+    }
+
+    void on_accept(boost::shared_ptr<MetricsConnection> connection, const boost::system::error_code& err)
+    {
+        if (err == error::operation_aborted) return;
+        if (!err) connection->start();
+        accept();
+    }
+};
+
+//-----------------------------------------------------------------------------
+// Main program
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+#if defined WIN32 or defined WINDOWS
+    SetConsoleCP(1251);
+    SetConsoleOutputCP(1251);
+#else
+    setlocale(LC_ALL, "Russian");
+#endif
+
+    if (!test_command_string(argc, argv, options)) {
+        std::cout << "Invalid command format." << std::endl;
+        std::cout << "Using: " << std::endl;
+        std::cout << "       testserver [-p|--port    <port of clients>]" << std::endl;
+        std::cout << "                  [-t|--threads <number of worker threads>]" << std::endl;
+        std::cout << "                  [-s|--shards  <number of storage shards>]" << std::endl;
+        std::cout << "                  [-f|--file    <storage file>]" << std::endl;
+        std::cout << "                  [-w|--wal     off|always|interval|os]" << std::endl;
+        std::cout << "                  [--wal-interval <milliseconds between fdatasync>]" << std::endl;
+        std::cout << "                  [--snapshot-size <MiB of journal between snapshots, 0 - off>]" << std::endl;
+        std::cout << "                  [--memory-limit <MiB of items, cold ones are evicted, 0 - off>]" << std::endl;
+        std::cout << "                  [--compress <bytes of value to keep it compressed, 0 - off>]" << std::endl;
+        std::cout << "                  [--idle-timeout <seconds without requests, 0 - off>]" << std::endl;
+        std::cout << "                  [--request-timeout <seconds to send request or read answer, 0 - off>]" << std::endl;
+        std::cout << "                  [--max-connections <clients at once, the next ones are busy, 0 - no limit>]" << std::endl;
+        std::cout << "                  [-m|--metrics-port <port of HTTP statistics on localhost>]" << std::endl;
+        std::cout << "                  [-l|--log-level error|warning|info|debug]" << std::endl;
+        std::cout << "                  [--log-rate <records of requests per second, 0 - all>]" << std::endl;
+        std::cout << "                  [--replica-of <address:port of primary>]" << std::endl;
+        return 2;
+    }
+
+    // Log is written by its own thread from now on.
+    logger().set_level(options.log_level);
+    logger().set_rate(options.log_rate);
+    logger().start();
+
+    // Replica takes the whole copy of primary at every connection to it.
+    if (options.primary_host.size()) options.journal.sync = JournalSync::Off;
+    storage.reset(new Storage(options.shards, options.journal, options.memory_limit, options.compress_min));
+
+    if (storage->load(options.storage_file_path)) {
+        logger().write(LogLevel::Error, "Error of open storage file. Server closing...");
+        logger().stop();
+        return 1;
+    }
+
+    io_service serv_service;
+
+    Timer timer(serv_service, Interval(time_interval));    
+    timer.async_wait(statistics_show_loop);
+    ptimer = &timer;
+
+    Timer expire_timer(serv_service, Interval(expire_interval));
+    expire_timer.async_wait(expire_loop);
+    pexpire_timer = &expire_timer;
+
+    boost::shared_ptr<Server> s = boost::make_shared<Server>(serv_service);
+    s->start();
+
+    // Storage file is closed cleanly on Ctrl+C and kill.
+    signal_set signals(serv_service, SIGINT, SIGTERM);
+    signals.async_wait([s](const boost::system::error_code& err, int) { if (!err) s->close(); });
+
+    if (options.primary_host.size()) {
+        auto replica = boost::make_shared<ReplicaClient>(serv_service, *storage, options.primary_host, options.primary_port);
+        replica->start();
+    }
+
+    if (options.metrics_port) {
+        auto metrics = boost::make_shared<MetricsServer>(serv_service);
+        metrics->start((unsigned short)options.metrics_port);
+    }
+
+    // Pool of threads: all of them run the same io_service,
+    // the main thread is one of the workers.
+    boost::thread_group workers;
+    for (unsigned int i = 1; i < options.threads; ++i)
+        workers.create_thread([&serv_service] { serv_service.run(); });
+    logger().write(LogLevel::Info, "Worker threads: %u", options.threads);
+
+    serv_service.run();
+    workers.join_all();
+
+    logger().write(LogLevel::Info, "Server closing...");
+    int result = 0;
+    if (storage->save()) {
+        logger().write(LogLevel::Error, "Error of save storage file.");
+        result = 1;
+    }
+    logger().stop();
+    return result;
+}
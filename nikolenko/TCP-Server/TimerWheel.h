@@ -0,0 +1,118 @@
+// TimerWheel.h
+// Hierarchical timer wheel of deadlines in seconds.
+//
+// Four levels of 64 slots: a slot of level 0 holds the entries of one
+// second, a slot of level 1 of 64 seconds and so on, together about 194 days
+// ahead; later deadlines wait in the last level and go round again. Adding
+// an entry is O(1). Every tick fires its slot of level 0, and every 64th
+// tick moves the entries of the next slot of the level above down to the
+// finer level (cascade), so an entry is moved at most three times.
+//
+// Entries are never removed: owner checks that the fired entry is still
+// actual, so a key whose deadline is changed simply gets one more entry.
+// advance() does a limited amount of work per call and may be called again
+// to go on, so a large slot never stalls the caller.
+
+#ifndef TCP_TEST_TIMER_WHEEL_H
+#define TCP_TEST_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+template<typename T>
+class TimerWheel {
+    static const unsigned    m_bits   = 6;
+    static const std::size_t m_slots  = std::size_t(1) << m_bits;
+    static const unsigned    m_levels = 4;
+
+    typedef std::vector<std::pair<std::uint64_t, T>> Slot;
+
+    Slot          m_wheel[m_levels][m_slots];
+    std::uint64_t m_now  = 0;       // All ticks up to this one are done
+    std::size_t   m_size = 0;
+
+public:
+    // Wheel starts at tick now, earlier deadlines fire at the next tick.
+    void reset(std::uint64_t now)
+    {
+        for (auto& level : m_wheel)
+            for (auto& slot : level) Slot().swap(slot);
+        m_now  = now;
+        m_size = 0;
+    }
+
+    std::size_t   size() const { return m_size; }
+    std::uint64_t now()  const { return m_now; }
+
+    void add(std::uint64_t deadline, T value)
+    {
+        place(std::max(deadline, m_now + 1), std::move(value));
+        ++m_size;
+    }
+
+    // Go to the tick now and call due(deadline, value) for the entries
+    // fired on the way. Return false when budget of entries moved or fired
+    // is spent before, the next call goes on from there.
+    template<typename F>
+    bool advance(std::uint64_t now, std::size_t budget, F due)
+    {
+        while (m_now < now) {
+            // Tick t is done when its slots are empty, so a call stopped
+            // in the middle of it repeats the tick from the start.
+            std::uint64_t t = m_now + 1;
+            for (unsigned level = m_levels - 1; level > 0; --level) {
+                if (t & ((std::uint64_t(1) << (m_bits * level)) - 1)) continue;
+                Slot& slot = m_wheel[level][(t >> (m_bits * level)) & (m_slots - 1)];
+                while (!slot.empty()) {
+                    if (!budget--) return false;
+                    auto entry = std::move(slot.back());
+                    slot.pop_back();
+                    place_from(t, entry.first, std::move(entry.second));
+                }
+                // Memory of a burst of entries is given back.
+                if (slot.capacity() > 1024) Slot().swap(slot);
+            }
+            Slot& slot = m_wheel[0][t & (m_slots - 1)];
+            while (!slot.empty()) {
+                if (!budget--) return false;
+                auto entry = std::move(slot.back());
+                slot.pop_back();
+                --m_size;
+                due(entry.first, entry.second);
+            }
+            if (slot.capacity() > 1024) Slot().swap(slot);
+            m_now = t;
+        }
+        return true;
+    }
+
+private:
+    void place(std::uint64_t deadline, T value)
+    {
+        place_from(m_now + 1, deadline, std::move(value));
+    }
+
+    // Entry of deadline not before tick t, which is not done yet. Slot of
+    // level is taken by the first level whose slots after tick t - 1 reach
+    // the deadline: 64 of them are ahead at every level. Too late deadline
+    // waits in the farthest slot of the last level.
+    void place_from(std::uint64_t t, std::uint64_t deadline, T value)
+    {
+        std::uint64_t base  = t - 1;
+        unsigned      level = 0;
+        std::uint64_t at    = deadline;
+        while ((at >> (m_bits * level)) - (base >> (m_bits * level)) > m_slots) {
+            if (++level == m_levels) {
+                --level;
+                at = ((base >> (m_bits * level)) + m_slots) << (m_bits * level);
+                break;
+            }
+        }
+        m_wheel[level][(at >> (m_bits * level)) & (m_slots - 1)].emplace_back(deadline, std::move(value));
+    }
+};
+
+#endif // TCP_TEST_TIMER_WHEEL_H
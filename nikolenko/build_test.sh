@@ -19,3 +19,13 @@ make
 cd    ../..
 rm -R ./TCP-Client/build
 pwd
+cd    ./TCP-Bench
+pwd
+mkdir ./build
+cd    ./build
+pwd
+cmake ..
+make 
+cd    ../..
+rm -R ./TCP-Bench/build
+pwd
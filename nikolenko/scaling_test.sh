@@ -0,0 +1,20 @@
+# Throughput of GET/INSERT by worker threads of server: 1, 2, 4, 8, 16.
+# Server of every run starts on a fresh storage file without journal,
+# kvbench gives the same load: 50% GET, 50% INSERT over 10M keys.
+# Run it from this directory after build_test.sh. Only the "Total:" line of kvbench is printed.
+cd        ./TCP-Test
+port=31498
+dir=$(mktemp -d)
+
+echo      Cores: $(nproc)
+for threads in 1 2 4 8 16; do
+    rm -f "$dir"/storage*
+    ./testserver -p $port -f "$dir/storage" -w off -t $threads >/dev/null 2>&1 < /dev/null &
+    server=$!
+    sleep 1
+    echo -n "Server threads $threads: "
+    ./kvbench --port $port -t 4 -c 64 -p 8 -d 10 -k 10000000 -m 50:50:0:0 -v 100 | grep "^Total:"
+    kill -INT $server
+    wait $server
+done
+rm -rf "$dir"
@@ -23,3 +23,7 @@ echo      Starting Client ...
 ./testclient GET    q1
 
 echo Exit from clients operations.
+
+echo      Starting load of server ...
+./kvbench --preload --duration 5
+./kvbench --duration 5 --pipeline 8 --zipf 0.99 --value-size 16-4096